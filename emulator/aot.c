@@ -0,0 +1,415 @@
+// ahead of time translator: turns an os and a program into C that runs them
+// natively. the control flow graph is recovered from the entry point, the
+// trap and interrupt vector tables and the BR, JSR and TRAP targets, and
+// every basic block becomes a label in one function that plugs into `run`
+// as ENGINE_AOT. whatever the translation cannot follow (JMP, JSRR and RTI
+// to an address that does not start a block, code that was never reached,
+// illegal opcodes and spins) goes to `run_decode` one instruction at a time
+// until it reaches a block again. a block compares its words with the ones
+// it was translated from on every entry, so code that was written over runs
+// on the interpreter too. the result prints the same output and final
+// machine state as `vboy` with the same os and program
+//
+// gcc -O2 ./emulator/aot.c -o ./aot
+// ./aot [-os <os.bin>] -b <program.bin> -o <program.c>
+// gcc -O2 -I ./emulator <program.c> -o ./program
+// ./program [-input <file>] [-sync] [-stats]
+#define VBOY_NO_MAIN
+#include "virtual_boy.c"
+
+#define AOT_MAX_BLOCK_LEN 64
+#define AOT_INTERPRET_SLICE 1024 // no block starts outside the images, see `emit_program`
+
+// per address, see `find_code`
+#define AOT_IMAGE   1 // loaded from the os or the program
+#define AOT_REACHED 2 // control flow gets here
+#define AOT_LEADER  4 // control flow can get here from somewhere else than the address before
+
+typedef struct {
+    uWord start;
+    uWord count;
+    size_t words; // where its words start in `original`
+} Block;
+
+typedef struct {
+    uint8_t flags[MEMORY_SIZE];
+    int32_t block_at[MEMORY_SIZE]; // the block starting at an address, -1 for none
+    Block* blocks;
+    size_t block_count;
+    uWord stack[MEMORY_SIZE]; // leaders still to walk
+    size_t stack_count;
+} Translation;
+
+// the instructions left to the interpreter: the ones it stops on, and
+// anything outside the images or in the i/o page
+bool is_translatable(const Translation* t, Memory memory, uWord addr) {
+    if ((t->flags[addr] & AOT_IMAGE) == 0 || addr >= MEM_IOREG_BEGIN) return false;
+    uint8_t kind = decode_table[read_memory(memory, addr)].kind;
+    return kind != DEC_RES && kind != DEC_SPIN;
+}
+
+void add_leader(Translation* t, Memory memory, uWord addr) {
+    if (!is_translatable(t, memory, addr) || (t->flags[addr] & AOT_LEADER) != 0) return;
+    t->flags[addr] |= AOT_LEADER;
+    t->stack[t->stack_count++] = addr;
+}
+
+bool ends_block(const Decoded* d) {
+    switch (d->kind) {
+        case DEC_BR: return d->r2 != 0; // a BR without a condition never branches
+        case DEC_JSR:
+        case DEC_JSRR:
+        case DEC_JMP:
+        case DEC_RTI:
+        case DEC_TRAP: return true;
+        default:       return false;
+    }
+}
+
+// walks from every leader to the end of its block, adding the targets it
+// finds on the way as new leaders
+void find_code(Translation* t, Memory memory) {
+    while (t->stack_count > 0) {
+        uWord addr = t->stack[--t->stack_count];
+        while (is_translatable(t, memory, addr) && (t->flags[addr] & AOT_REACHED) == 0) {
+            t->flags[addr] |= AOT_REACHED;
+            Decoded d = decode_table[read_memory(memory, addr)];
+            uWord next = addr + 1;
+            if (!ends_block(&d)) {
+                addr = next;
+                continue;
+            }
+            switch (d.kind) {
+                case DEC_BR:
+                case DEC_JSR: add_leader(t, memory, next + d.imm); break;
+                case DEC_TRAP: {
+                    uint8_t trap_8 = d.imm & 0xFF;
+                    if (trap_8 != TRAP_GETC && trap_8 != TRAP_OUT && trap_8 != TRAP_HALT) {
+                        add_leader(t, memory, read_memory(memory, trap_8 + MEM_TRAPVT_BEGIN));
+                    }
+                } break;
+                default: break;
+            }
+            // returned to by RET or RTI, or the BR not taken
+            if (d.kind != DEC_JMP && d.kind != DEC_RTI) add_leader(t, memory, next);
+            break;
+        }
+    }
+}
+
+// cuts what `find_code` reached into blocks, at leaders, after the
+// instructions that end one and at AOT_MAX_BLOCK_LEN
+void split_blocks(Translation* t, Memory memory) {
+    t->blocks = malloc(MEMORY_SIZE * sizeof(*t->blocks));
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) t->block_at[addr] = -1;
+    size_t words = 0;
+    for (size_t addr = 0; addr < MEMORY_SIZE;) {
+        if ((t->flags[addr] & AOT_REACHED) == 0) {
+            addr++;
+            continue;
+        }
+        Block block = { .start = addr, .words = words };
+        for (;;) {
+            Decoded d = decode_table[read_memory(memory, addr)];
+            block.count++;
+            addr++;
+            if (ends_block(&d) || block.count == AOT_MAX_BLOCK_LEN || addr == MEMORY_SIZE) break;
+            if ((t->flags[addr] & AOT_REACHED) == 0 || (t->flags[addr] & AOT_LEADER) != 0) break;
+        }
+        t->block_at[block.start] = t->block_count;
+        t->blocks[t->block_count++] = block;
+        words += block.count;
+    }
+}
+
+// machine->icount and left were moved past the whole block on entry, these
+// give back the instructions after the current one when it leaves early
+void emit_give_back(FILE* out, size_t rest) {
+    if (rest > 0) fprintf(out, "        left += %zu;\n        machine->icount -= %zu;\n", rest, rest);
+}
+
+void emit_goto(FILE* out, const Translation* t, uWord target, const char* indent) {
+    if (t->block_at[target] >= 0) fprintf(out, "%sgoto b_%04X;\n", indent, target);
+    else fprintf(out, "%smachine->PC = 0x%04X;\n%sgoto interpret;\n", indent, target, indent);
+}
+
+// `run` looks at events after the instructions that can raise them, and
+// an interrupt it takes moves PC
+void emit_events(FILE* out, uWord next, size_t rest) {
+    fprintf(out, "    if (machine->event) {\n");
+    fprintf(out, "        machine->PC = 0x%04X;\n", next);
+    fprintf(out, "        if (!handle_events(machine, memory, &reason)) {\n");
+    if (rest > 0) fprintf(out, "            left += %zu;\n            machine->icount -= %zu;\n", rest, rest);
+    fprintf(out, "            return reason;\n        }\n");
+    fprintf(out, "        if (machine->PC != 0x%04X) {\n", next);
+    if (rest > 0) fprintf(out, "            left += %zu;\n            machine->icount -= %zu;\n", rest, rest);
+    fprintf(out, "            goto dispatch;\n        }\n    }\n");
+}
+
+// a store into the rest of the block changes instructions it is about to run
+void emit_store_check(FILE* out, const char* addr, uWord next, size_t rest) {
+    if (rest == 0) return;
+    fprintf(out, "    if ((uWord)(%s - 0x%04X) < %zu) {\n", addr, next, rest);
+    fprintf(out, "        machine->PC = 0x%04X;\n", next);
+    emit_give_back(out, rest);
+    fprintf(out, "        goto dispatch;\n    }\n");
+}
+
+// one instruction the way `run_decode_loop` runs it, with PC already past it.
+// machine->PC is only written where something reads it: the keyboard looks
+// at it when it is polled, traps and interrupts push it
+void emit_instruction(FILE* out, const Translation* t, uWord pc, Instruction inst, size_t rest) {
+    Decoded d = decode_table[inst];
+    uWord next = pc + 1;
+    fprintf(out, "    // x%04X x%04X\n", pc, inst);
+    switch (d.kind) {
+        case DEC_BR: {
+            if (d.r2 == 0) break;
+            fprintf(out, "    if ((read_flags(machine) & %d) != 0) {\n", d.r2);
+            emit_goto(out, t, next + d.imm, "        ");
+            fprintf(out, "    }\n");
+        } break;
+        case DEC_ADD_REG:
+        case DEC_AND_REG: {
+            fprintf(out, "    result = R[%d] %c R[%d];\n", d.r1, d.kind == DEC_ADD_REG ? '+' : '&', d.r2);
+            fprintf(out, "    set_flags_from_result(machine, result);\n    R[%d] = result;\n", d.r0);
+        } break;
+        case DEC_ADD_IMM:
+        case DEC_AND_IMM: {
+            fprintf(out, "    result = R[%d] %c %d;\n", d.r1, d.kind == DEC_ADD_IMM ? '+' : '&', d.imm);
+            fprintf(out, "    set_flags_from_result(machine, result);\n    R[%d] = result;\n", d.r0);
+        } break;
+        case DEC_NOT: {
+            fprintf(out, "    result = ~R[%d];\n", d.r1);
+            fprintf(out, "    set_flags_from_result(machine, result);\n    R[%d] = result;\n", d.r0);
+        } break;
+        case DEC_LEA: {
+            fprintf(out, "    result = (Word)0x%04X;\n", (uWord)(next + d.imm));
+            fprintf(out, "    R[%d] = result;\n    set_flags_from_result(machine, result);\n", d.r0);
+        } break;
+        case DEC_LD:
+        case DEC_LDI:
+        case DEC_LDR: {
+            uWord addr = next + d.imm;
+            if (d.kind != DEC_LD || addr >= MEM_IOREG_BEGIN) fprintf(out, "    machine->PC = 0x%04X;\n", next);
+            if (d.kind == DEC_LD) fprintf(out, "    result = load_memory(machine, memory, 0x%04X);\n", addr);
+            if (d.kind == DEC_LDI) fprintf(out, "    result = load_memory(machine, memory, load_memory(machine, memory, 0x%04X));\n", addr);
+            if (d.kind == DEC_LDR) fprintf(out, "    result = load_memory(machine, memory, (uWord)(R[%d] + %d));\n", d.r1, d.imm);
+            fprintf(out, "    R[%d] = result;\n    set_flags_from_result(machine, result);\n", d.r0);
+        } break;
+        case DEC_ST: {
+            uWord addr = next + d.imm;
+            if (addr >= MEM_IOREG_BEGIN) fprintf(out, "    machine->PC = 0x%04X;\n", next);
+            fprintf(out, "    write_memory(machine, memory, 0x%04X, R[%d]);\n", addr, d.r0);
+            if ((uWord)(addr - next) < rest) {
+                fprintf(out, "    machine->PC = 0x%04X;\n", next);
+                fprintf(out, "    left += %zu;\n    machine->icount -= %zu;\n    goto dispatch;\n", rest, rest);
+            } else if (addr >= MEM_IOREG_BEGIN) {
+                emit_events(out, next, rest);
+            }
+        } break;
+        case DEC_STI:
+        case DEC_STR: {
+            fprintf(out, "    machine->PC = 0x%04X;\n", next);
+            if (d.kind == DEC_STI) fprintf(out, "    addr = load_memory(machine, memory, 0x%04X);\n", (uWord)(next + d.imm));
+            else fprintf(out, "    addr = R[%d] + %d;\n", d.r1, d.imm);
+            fprintf(out, "    write_memory(machine, memory, addr, R[%d]);\n", d.r0);
+            emit_events(out, next, rest);
+            emit_store_check(out, "addr", next, rest);
+        } break;
+        case DEC_JMP: {
+            fprintf(out, "    machine->PC = R[%d];\n    goto dispatch;\n", d.r1);
+        } break;
+        case DEC_JSR: {
+            fprintf(out, "    R[7] = (Word)0x%04X;\n", next);
+            emit_goto(out, t, next + d.imm, "    ");
+        } break;
+        case DEC_JSRR: {
+            // R7 first, a JSRR through R7 jumps to the next instruction
+            fprintf(out, "    R[7] = (Word)0x%04X;\n    machine->PC = R[%d];\n    goto dispatch;\n", next, d.r1);
+        } break;
+        case DEC_RTI:
+        case DEC_TRAP: {
+            fprintf(out, "    machine->PC = 0x%04X;\n", next);
+            fprintf(out, "    %s(%d, machine, memory);\n", d.kind == DEC_RTI ? "op_rti" : "op_trap", d.imm);
+            fprintf(out, "    if (machine->event && !handle_events(machine, memory, &reason)) return reason;\n");
+            fprintf(out, "    goto dispatch;\n");
+        } break;
+        default: {
+            assert(false && "not translated");
+        } break;
+    }
+}
+
+void emit_bytes(FILE* out, const char* name, const Byte_Data* data) {
+    fprintf(out, "static uint8_t %s[] = {", name);
+    for (size_t i = 0; i < data->count; i++) fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n    " : " ", data->bytes[i]);
+    fprintf(out, "%s};\n\n", data->count == 0 ? "0" : "\n");
+}
+
+void emit_program(FILE* out, const Translation* t, Memory memory, const Byte_Data* os, const Byte_Data* program, char* os_file_name, char* program_file_name) {
+    fprintf(out, "// translated by aot from %s and %s, do not edit\n", os_file_name != NULL ? os_file_name : "no os", program_file_name);
+    fprintf(out, "#define VBOY_NO_MAIN\n#include \"virtual_boy.c\"\n\n");
+    if (os != NULL) emit_bytes(out, "os_image", os);
+    emit_bytes(out, "program_image", program);
+
+    // the words every block was translated from
+    fprintf(out, "static const uWord original[] = {");
+    size_t words = 0;
+    for (size_t i = 0; i < t->block_count; i++) {
+        for (uWord j = 0; j < t->blocks[i].count; j++) {
+            fprintf(out, "%s0x%04X,", words++ % 12 == 0 ? "\n    " : " ", read_memory(memory, t->blocks[i].start + j));
+        }
+    }
+    fprintf(out, "%s};\n\n", words == 0 ? "0" : "\n");
+
+    // blocks only start in the images, so outside of them the interpreter
+    // can take more than one instruction at a time
+    size_t os_end = os != NULL ? (os->count + 1) / 2 : 0;
+    size_t program_end = MEM_USERSPC_BEGIN + (program->count + 1) / 2;
+    fprintf(out, "static inline bool in_image(uWord addr) {\n");
+    fprintf(out, "    return addr < 0x%04zX || (addr >= 0x%04X && addr < 0x%04zX);\n}\n\n", os_end, MEM_USERSPC_BEGIN, program_end);
+
+    fprintf(out, "static inline bool unchanged(Memory memory, uWord addr, const uWord* words, int count) {\n");
+    fprintf(out, "    for (int i = 0; i < count; i++) {\n");
+    fprintf(out, "        if (read_memory(memory, addr + i) != words[i]) return false;\n");
+    fprintf(out, "    }\n    return true;\n}\n\n");
+
+    fprintf(out, "Stop_Reason run_translated(Machine* machine, Memory memory, uint64_t max_instructions) {\n");
+    fprintf(out, "    Word* R = machine->registers;\n");
+    fprintf(out, "    Word result;\n    uWord addr;\n");
+    fprintf(out, "    (void)R;\n    (void)result;\n    (void)addr;\n");
+    fprintf(out, "    Stop_Reason reason = STOP_BUDGET;\n");
+    fprintf(out, "    uint64_t left = max_instructions;\n");
+    fprintf(out, "    if (left == 0) return reason;\n");
+    fprintf(out, "    if (!handle_events(machine, memory, &reason)) return reason;\n");
+    fprintf(out, "dispatch:\n    switch (machine->PC) {\n");
+    for (size_t i = 0; i < t->block_count; i++) {
+        fprintf(out, "        case 0x%04X: goto b_%04X;\n", t->blocks[i].start, t->blocks[i].start);
+    }
+    fprintf(out, "    }\n");
+    fprintf(out, "interpret:\n");
+    fprintf(out, "    if (left == 0) return STOP_BUDGET;\n");
+    fprintf(out, "    {\n");
+    fprintf(out, "        // a taken spin gets the whole budget, like in `run_jit`\n");
+    fprintf(out, "        Decoded d = decode_at(machine, memory, machine->PC);\n");
+    fprintf(out, "        bool spin = d.kind == DEC_SPIN && (read_flags(machine) & d.r2) != 0;\n");
+    fprintf(out, "        uint64_t before = machine->icount;\n");
+    fprintf(out, "        uint64_t slice = spin ? left : in_image(machine->PC) ? 1 : left < %d ? left : %d;\n", AOT_INTERPRET_SLICE, AOT_INTERPRET_SLICE);
+    fprintf(out, "        reason = run_decode(machine, memory, slice);\n");
+    fprintf(out, "        left -= machine->icount - before;\n");
+    fprintf(out, "        if (reason != STOP_BUDGET || machine->rescheduled != 0) return reason;\n");
+    fprintf(out, "    }\n    goto dispatch;\n");
+
+    for (size_t i = 0; i < t->block_count; i++) {
+        const Block* block = &t->blocks[i];
+        fprintf(out, "\nb_%04X:\n", block->start);
+        fprintf(out, "    if (left < %d || !unchanged(memory, 0x%04X, &original[%zu], %d)) {\n", block->count, block->start, block->words, block->count);
+        fprintf(out, "        machine->PC = 0x%04X;\n        goto interpret;\n    }\n", block->start);
+        fprintf(out, "    left -= %d;\n    machine->icount += %d;\n", block->count, block->count);
+        for (uWord j = 0; j < block->count; j++) {
+            uWord pc = block->start + j;
+            emit_instruction(out, t, pc, read_memory(memory, pc), block->count - j - 1);
+        }
+        Decoded last = decode_table[read_memory(memory, block->start + block->count - 1)];
+        if (!ends_block(&last) || last.kind == DEC_BR) {
+            uWord next = block->start + block->count;
+            bool falls_into_next = i + 1 < t->block_count && t->blocks[i + 1].start == next;
+            if (!falls_into_next) emit_goto(out, t, next, "    ");
+        }
+    }
+    fprintf(out, "}\n\n");
+
+    // the same run as `vboy -os <os> -b <program>`
+    fprintf(out, "int main(int argc, char** argv) {\n");
+    fprintf(out, "    Machine machine = init_machine();\n");
+    fprintf(out, "    Memory memory = init_sparse_memory();\n");
+    fprintf(out, "    machine.engine = ENGINE_AOT;\n");
+    fprintf(out, "    machine.translated = run_translated;\n");
+    fprintf(out, "    char* input_file_name = NULL;\n");
+    fprintf(out, "    bool sync_io = false;\n    bool stats = false;\n");
+    fprintf(out, "    for (int i = 1; i < argc; i++) {\n");
+    fprintf(out, "        if (strcmp(argv[i], \"-input\") == 0 && i + 1 < argc) input_file_name = argv[++i];\n");
+    fprintf(out, "        else if (strcmp(argv[i], \"-sync\") == 0) sync_io = true;\n");
+    fprintf(out, "        else if (strcmp(argv[i], \"-stats\") == 0) stats = true;\n");
+    fprintf(out, "        else {\n");
+    fprintf(out, "            printf(\"Usage: %%s [-input <file>] [-sync] [-stats]\\n\", argv[0]);\n");
+    fprintf(out, "            return 1;\n        }\n    }\n\n");
+    if (os != NULL) fprintf(out, "    Byte_Data os = { os_image, sizeof(os_image), %zu };\n", os->count);
+    fprintf(out, "    Byte_Data program = { program_image, sizeof(program_image), %zu };\n", program->count);
+    fprintf(out, "    if (!boot_machine(&machine, memory, %s, &program)) return 1;\n", os != NULL ? "&os" : "NULL");
+    fprintf(out, "    Console console = init_console(stdout);\n");
+    fprintf(out, "    machine.console = &console;\n");
+    fprintf(out, "    attach_standard_devices(&machine);\n");
+    fprintf(out, "    Byte_Data input = {0};\n");
+    fprintf(out, "    if (input_file_name != NULL) {\n");
+    fprintf(out, "        input = load_image(input_file_name);\n");
+    fprintf(out, "        machine.input = &input;\n    }\n");
+    fprintf(out, "    Host_Io* host = sync_io ? NULL : malloc(sizeof(*host));\n");
+    fprintf(out, "    if (host != NULL && start_host_io(host, stdout)) {\n");
+    fprintf(out, "        console.host = host;\n        machine.host = host;\n    }\n");
+    fprintf(out, "    execute_program(&machine, memory);\n");
+    fprintf(out, "    if (machine.host != NULL) stop_host_io(machine.host);\n");
+    fprintf(out, "    print_machine_state(&machine);\n");
+    fprintf(out, "    if (stats) {\n");
+    fprintf(out, "        fprintf(stderr, \"console: %%llu bytes written, %%llu flushes\\n\",\n");
+    fprintf(out, "                (unsigned long long)console.bytes, (unsigned long long)console.flushes);\n");
+    fprintf(out, "        if (machine.host != NULL) fprintf(stderr, \"idle: %%llu polling loops parked\\n\", (unsigned long long)machine.host->parked);\n");
+    fprintf(out, "    }\n    return 0;\n}\n");
+}
+
+void usage(char* program) {
+    printf("Usage: %s [-os <os.bin>] -b <program.bin> -o <program.c>\n", program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    char* os_file_name = NULL;
+    char* program_file_name = NULL;
+    char* output_file_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) usage(argv[0]);
+        if (strcmp(argv[i], "-os") == 0) os_file_name = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0) program_file_name = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0) output_file_name = argv[++i];
+        else usage(argv[0]);
+    }
+    if (program_file_name == NULL || output_file_name == NULL) usage(argv[0]);
+
+    Machine machine = init_machine();
+    Memory memory = init_memory();
+    Byte_Data os = {0};
+    if (os_file_name != NULL) os = load_image(os_file_name);
+    Byte_Data program = load_image(program_file_name);
+    if (!boot_machine(&machine, memory, os_file_name != NULL ? &os : NULL, &program)) return 1;
+
+    Translation* t = calloc(1, sizeof(*t));
+    for (size_t i = 0; i < (os.count + 1) / 2; i++) t->flags[MEM_BEGIN + i] |= AOT_IMAGE;
+    for (size_t i = 0; i < (program.count + 1) / 2 && MEM_USERSPC_BEGIN + i < MEMORY_SIZE; i++) {
+        t->flags[MEM_USERSPC_BEGIN + i] |= AOT_IMAGE;
+    }
+    add_leader(t, memory, machine.PC);
+    add_leader(t, memory, MEM_USERSPC_BEGIN); // the os jumps there through a register
+    // a vector the os left at zero is not set, not a routine at x0000
+    for (uWord vector = MEM_TRAPVT_BEGIN; vector <= MEM_INTERVT_END; vector++) {
+        uWord routine = read_memory(memory, vector);
+        if ((t->flags[vector] & AOT_IMAGE) != 0 && routine != 0) add_leader(t, memory, routine);
+    }
+    find_code(t, memory);
+    split_blocks(t, memory);
+
+    FILE* out = fopen(output_file_name, "w");
+    if (out == NULL) {
+        printf("[ERROR] could not open `%s`\n", output_file_name);
+        return 1;
+    }
+    emit_program(out, t, memory, os_file_name != NULL ? &os : NULL, &program, os_file_name, program_file_name);
+    fclose(out);
+    free_image(&os);
+    free_image(&program);
+
+    size_t translated = 0;
+    for (size_t i = 0; i < t->block_count; i++) translated += t->blocks[i].count;
+    printf("%zu blocks, %zu instructions translated\n", t->block_count, translated);
+    return 0;
+}
@@ -0,0 +1,94 @@
+// microbenchmark for the instruction decoder: the per-field masking the op_*
+// functions do against a lookup into `decode_table`
+//
+// gcc -O2 ./emulator/decode_bench.c -o ./decode_bench
+#define VBOY_NO_MAIN
+#include "virtual_boy.c"
+
+#define STREAM_LENGTH (1 << 16)
+#define ROUNDS 200
+
+// sums the fields so the compiler cant throw the decoding away
+uint32_t checksum(Decoded d) {
+    return d.kind + d.r0 * 3 + d.r1 * 5 + d.r2 * 7 + (uWord)d.imm;
+}
+
+void report(char* name, double seconds, uint64_t count, uint32_t sum) {
+    printf("%-24s %8.3f s %10.1f M/s  (checksum %08x)\n", name, seconds, (double)count / seconds * 1e-6, sum);
+}
+
+// instructions that can be executed back to back without a program around
+// them: no stores, traps, jumps or illegal opcodes
+bool is_benign(Instruction inst) {
+    switch (decode_table[inst].kind) {
+        case DEC_BR:
+        case DEC_ADD_REG:
+        case DEC_ADD_IMM:
+        case DEC_AND_REG:
+        case DEC_AND_IMM:
+        case DEC_NOT:
+        case DEC_LD:
+        case DEC_LDI:
+        case DEC_LDR:
+        case DEC_LEA: return true;
+        default:      return false;
+    }
+}
+
+int main() {
+    uint64_t start = now_nanoseconds();
+    init_decode_table();
+    printf("%-24s %8.3f s\n", "building decode_table", (now_nanoseconds() - start) * 1e-9);
+
+    Instruction* stream = malloc(STREAM_LENGTH * sizeof(*stream));
+    uint32_t state = 0x1234567;
+    for (size_t i = 0; i < STREAM_LENGTH; i++) stream[i] = next_random(&state);
+
+    uint64_t count = (uint64_t)STREAM_LENGTH * ROUNDS;
+    uint32_t masked_sum = 0;
+    start = now_nanoseconds();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < STREAM_LENGTH; i++) masked_sum += checksum(decode_instruction(stream[i]));
+    }
+    report("decode, masking", (now_nanoseconds() - start) * 1e-9, count, masked_sum);
+
+    uint32_t table_sum = 0;
+    start = now_nanoseconds();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < STREAM_LENGTH; i++) table_sum += checksum(decode_table[stream[i]]);
+    }
+    report("decode, table", (now_nanoseconds() - start) * 1e-9, count, table_sum);
+
+    if (masked_sum != table_sum) {
+        printf("[ERROR] decode_table does not match decode_instruction\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < STREAM_LENGTH; i++) {
+        while (!is_benign(stream[i])) stream[i] = next_random(&state);
+    }
+
+    Memory memory = init_memory();
+    for (size_t i = 0; i < MEMORY_SIZE; i++) poke_memory(memory, i, next_random(&state));
+
+    Machine masked = init_machine();
+    start = now_nanoseconds();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < STREAM_LENGTH; i++) execute_instruction_masked(&masked, stream[i], memory);
+    }
+    report("execute, masking", (now_nanoseconds() - start) * 1e-9, count, (uWord)masked.registers[0] + masked.PC);
+
+    Machine table = init_machine();
+    start = now_nanoseconds();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < STREAM_LENGTH; i++) execute_instruction(&table, stream[i], memory);
+    }
+    report("execute, table", (now_nanoseconds() - start) * 1e-9, count, (uWord)table.registers[0] + table.PC);
+
+    if (memcmp(masked.registers, table.registers, sizeof(masked.registers)) != 0 || masked.PC != table.PC ||
+        read_psr(&masked) != read_psr(&table)) {
+        printf("[ERROR] execute_instruction does not match execute_instruction_masked\n");
+        return 1;
+    }
+    return 0;
+}
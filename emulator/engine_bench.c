@@ -0,0 +1,353 @@
+// end to end benchmark for the engines: generated LC3 programs that each
+// lean on one kind of instruction, run to HALT on every engine, reported in
+// retired instructions per second. every workload gets a warmup run and then
+// `-runs` timed ones on a fresh machine each, `-o` also writes the numbers
+// as csv so two builds can be compared
+//
+// gcc -O2 ./emulator/engine_bench.c -o ./engine_bench
+// ./engine_bench [-runs <n>] [-scale <x>] [-label <build name>] [-o <results.csv>]
+#define VBOY_NO_MAIN
+#include "virtual_boy.c"
+
+#define BENCH_MAX_WORDS 256
+#define BENCH_MAX_RUNS  100
+
+// a program is built straight into words, loaded at MEM_USERSPC_BEGIN:
+// a branch over the constants, the constants, then the code
+typedef struct {
+    uWord words[BENCH_MAX_WORDS];
+    size_t count;
+    size_t header; // the branch over the constants and subroutines
+} Program;
+
+#define R0 0
+#define R1 1
+#define R2 2
+#define R3 3
+#define R4 4
+#define R5 5
+#define R6 6
+#define R7 7
+
+// only masks that read the same with n and p swapped, see `op_br`
+#define BR_NZP 7
+#define BR_NP  5
+#define BR_Z   2
+
+uWord enc_add(int dr, int sr1, int sr2)  { return 0x1000 | dr << 9 | sr1 << 6 | sr2; }
+uWord enc_addi(int dr, int sr, int imm)  { return 0x1000 | dr << 9 | sr << 6 | 0x20 | (imm & 0x1F); }
+uWord enc_and(int dr, int sr1, int sr2)  { return 0x5000 | dr << 9 | sr1 << 6 | sr2; }
+uWord enc_andi(int dr, int sr, int imm)  { return 0x5000 | dr << 9 | sr << 6 | 0x20 | (imm & 0x1F); }
+uWord enc_not(int dr, int sr)            { return 0x903F | dr << 9 | sr << 6; }
+uWord enc_br(int nzp, int offset)        { return nzp << 9 | (offset & 0x1FF); }
+// the offset is not sign extended, see `op_ldr`, so only positive ones here
+uWord enc_ldr(int dr, int base, int off) { return 0x6000 | dr << 9 | base << 6 | (off & 0x3F); }
+uWord enc_str(int sr, int base, int off) { return 0x7000 | sr << 9 | base << 6 | (off & 0x3F); }
+uWord enc_ret()                          { return 0xC1C0; }
+uWord enc_trap(int vector)               { return 0xF000 | vector; }
+
+size_t emit(Program* program, uWord word) {
+    assert(program->count < BENCH_MAX_WORDS);
+    program->words[program->count] = word;
+    return program->count++;
+}
+
+// pc relative instructions, `target` is an index into `words`
+void emit_pc_relative(Program* program, uWord opcode, int reg, size_t target) {
+    int offset = (int)target - (int)(program->count + 1);
+    emit(program, opcode | reg << 9 | (offset & 0x1FF));
+}
+
+void emit_ld(Program* p, int dr, size_t target)  { emit_pc_relative(p, 0x2000, dr, target); }
+void emit_ldi(Program* p, int dr, size_t target) { emit_pc_relative(p, 0xA000, dr, target); }
+void emit_sti(Program* p, int sr, size_t target) { emit_pc_relative(p, 0xB000, sr, target); }
+
+void emit_br(Program* program, int nzp, size_t target) {
+    emit(program, enc_br(nzp, (int)target - (int)(program->count + 1)));
+}
+
+void emit_jsr(Program* program, size_t target) {
+    int offset = (int)target - (int)(program->count + 1);
+    emit(program, 0x4800 | (offset & 0x7FF));
+}
+
+// the constants come right after the header, constant i is at index i + 1
+void emit_header(Program* program, const uWord* constants, size_t count) {
+    program->count = 0;
+    program->header = emit(program, 0);
+    for (size_t i = 0; i < count; i++) emit(program, constants[i]);
+}
+
+// the code starts here, anything between the constants and this are subroutines
+void begin_main(Program* program) {
+    program->words[program->header] = enc_br(BR_NZP, (int)program->count - (int)(program->header + 1));
+}
+
+// counts `reg` down and goes back to `top` until it is zero
+void emit_loop_end(Program* program, int reg, size_t top) {
+    emit(program, enc_addi(reg, reg, -1));
+    emit_br(program, BR_NP, top);
+}
+
+#define C_INNER 1
+#define C_OUTER 2
+
+// R1 counts the outer loop down from C_OUTER, the inner loop counts from
+// C_INNER in R0 and the body goes in there. the top of the outer loop
+size_t begin_loops(Program* program) {
+    emit_ld(program, R1, C_OUTER);
+    return program->count;
+}
+
+void build_alu(Program* p, uWord outer) {
+    emit_header(p, (uWord[]){ 1000, outer }, 2);
+    begin_main(p);
+    size_t outer_top = begin_loops(p);
+    emit_ld(p, R0, C_INNER);
+    size_t inner_top = p->count;
+    emit(p, enc_addi(R2, R2, 3));
+    emit(p, enc_andi(R3, R2, 7));
+    emit(p, enc_not(R4, R3));
+    emit(p, enc_add(R5, R4, R2));
+    emit(p, enc_and(R6, R5, R2));
+    emit(p, enc_not(R2, R6));
+    emit(p, enc_add(R3, R3, R5));
+    emit(p, enc_andi(R4, R4, -2));
+    emit_loop_end(p, R0, inner_top);
+    emit_loop_end(p, R1, outer_top);
+    emit(p, enc_trap(TRAP_HALT));
+}
+
+// walks 16K words at x4000 every outer round
+void build_memory(Program* p, uWord outer) {
+    enum { C_BASE = 3 };
+    emit_header(p, (uWord[]){ 8192, outer, 0x4000 }, 3);
+    begin_main(p);
+    size_t outer_top = begin_loops(p);
+    emit_ld(p, R0, C_INNER);
+    emit_ld(p, R2, C_BASE);
+    size_t inner_top = p->count;
+    emit(p, enc_ldr(R3, R2, 0));
+    emit(p, enc_addi(R3, R3, 1));
+    emit(p, enc_str(R3, R2, 0));
+    emit(p, enc_ldr(R4, R2, 1));
+    emit(p, enc_add(R4, R4, R3));
+    emit(p, enc_str(R4, R2, 1));
+    emit(p, enc_addi(R2, R2, 2));
+    emit_loop_end(p, R0, inner_top);
+    emit_loop_end(p, R1, outer_top);
+    emit(p, enc_trap(TRAP_HALT));
+}
+
+// branches on the low bits of a counter, so they go both ways in a pattern
+void build_branches(Program* p, uWord outer) {
+    emit_header(p, (uWord[]){ 1000, outer }, 2);
+    begin_main(p);
+    size_t outer_top = begin_loops(p);
+    emit_ld(p, R0, C_INNER);
+    size_t inner_top = p->count;
+    emit(p, enc_addi(R2, R2, 1));
+    emit(p, enc_andi(R3, R2, 1));
+    emit(p, enc_br(BR_Z, 1));
+    emit(p, enc_addi(R4, R4, 1));
+    emit(p, enc_andi(R3, R2, 2));
+    emit(p, enc_br(BR_Z, 1));
+    emit(p, enc_addi(R5, R5, 1));
+    emit(p, enc_andi(R3, R2, 4));
+    emit(p, enc_br(BR_Z, 1));
+    emit(p, enc_addi(R6, R6, -1));
+    emit(p, enc_br(BR_NZP, 0));
+    emit_loop_end(p, R0, inner_top);
+    emit_loop_end(p, R1, outer_top);
+    emit(p, enc_trap(TRAP_HALT));
+}
+
+// three deep, the outer two keep R7 on a stack in R6
+void build_calls(Program* p, uWord outer) {
+    enum { C_STACK = 3 };
+    emit_header(p, (uWord[]){ 1000, outer, 0x7000 }, 3);
+    size_t leaf = emit(p, enc_addi(R2, R2, 1));
+    emit(p, enc_ret());
+    size_t callers[2];
+    size_t callee = leaf;
+    for (int i = 0; i < 2; i++) {
+        callers[i] = emit(p, enc_addi(R6, R6, -1));
+        emit(p, enc_str(R7, R6, 0));
+        emit_jsr(p, callee);
+        emit(p, enc_ldr(R7, R6, 0));
+        emit(p, enc_addi(R6, R6, 1));
+        emit(p, enc_ret());
+        callee = callers[i];
+    }
+    begin_main(p);
+    emit_ld(p, R6, C_STACK);
+    size_t outer_top = begin_loops(p);
+    emit_ld(p, R0, C_INNER);
+    size_t inner_top = p->count;
+    emit_jsr(p, callee);
+    emit_loop_end(p, R0, inner_top);
+    emit_loop_end(p, R1, outer_top);
+    emit(p, enc_trap(TRAP_HALT));
+}
+
+// every load and store goes through a pointer
+void build_indirect(Program* p, uWord outer) {
+    enum { C_FIRST = 3, C_SECOND = 4 };
+    emit_header(p, (uWord[]){ 1000, outer, 0x4000, 0x4001 }, 4);
+    begin_main(p);
+    size_t outer_top = begin_loops(p);
+    emit_ld(p, R0, C_INNER);
+    size_t inner_top = p->count;
+    emit_ldi(p, R3, C_FIRST);
+    emit(p, enc_addi(R3, R3, 1));
+    emit_sti(p, R3, C_SECOND);
+    emit_ldi(p, R4, C_SECOND);
+    emit(p, enc_add(R4, R4, R3));
+    emit_sti(p, R4, C_FIRST);
+    emit_loop_end(p, R0, inner_top);
+    emit_loop_end(p, R1, outer_top);
+    emit(p, enc_trap(TRAP_HALT));
+}
+
+// TRAP x21 with a bit of work around it, the output is captured. OUT
+// prints R0, so the inner loop counts in R5 here
+void build_output(Program* p, uWord outer) {
+    enum { C_CHAR = 3 };
+    emit_header(p, (uWord[]){ 1000, outer, 'a' }, 3);
+    begin_main(p);
+    size_t outer_top = begin_loops(p);
+    emit_ld(p, R5, C_INNER);
+    size_t inner_top = p->count;
+    emit_ld(p, R0, C_CHAR);
+    emit(p, enc_trap(TRAP_OUT));
+    emit(p, enc_addi(R0, R0, 1));
+    emit(p, enc_trap(TRAP_OUT));
+    emit(p, enc_addi(R2, R2, 1));
+    emit_loop_end(p, R5, inner_top);
+    emit_loop_end(p, R1, outer_top);
+    emit(p, enc_trap(TRAP_HALT));
+}
+
+typedef struct {
+    char* name;
+    void (*build)(Program* program, uWord outer);
+    uWord outer; // rounds of the outer loop at -scale 1
+} Workload;
+
+// about 10-20M instructions each at -scale 1
+static const Workload workloads[] = {
+    { "alu",      build_alu,      1600 },
+    { "memory",   build_memory,   220 },
+    { "branches", build_branches, 1300 },
+    { "calls",    build_calls,    1000 },
+    { "indirect", build_indirect, 1800 },
+    { "output",   build_output,   1000 },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+// what a run ended with, every engine has to end the same way
+typedef struct {
+    Stop_Reason reason;
+    uint64_t icount;
+    uint32_t checksum; // registers and output
+} Outcome;
+
+// one run on a fresh machine, the seconds it took
+double run_program(const Program* program, Engine engine, Outcome* outcome) {
+    Machine machine = init_machine();
+    Memory memory = init_memory();
+    Console console = init_console(NULL);
+    machine.engine = engine;
+    machine.console = &console;
+    boot_words(&machine, memory, program->words, program->count);
+
+    uint64_t start = now_nanoseconds();
+    outcome->reason = run(&machine, memory, RUN_FOREVER);
+    double seconds = (now_nanoseconds() - start) * 1e-9;
+
+    outcome->icount = machine.icount;
+    uint32_t sum = 2166136261u; // fnv
+    for (int i = 0; i < 8; i++) sum = (sum ^ (uWord)machine.registers[i]) * 16777619u;
+    for (size_t i = 0; i < console.buffer.count; i++) sum = (sum ^ console.buffer.bytes[i]) * 16777619u;
+    outcome->checksum = sum;
+    free(console.buffer.bytes);
+    free_machine(&machine);
+    free_memory(memory);
+    return seconds;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void usage(char* program) {
+    printf("Usage: %s [-runs <n>] [-scale <x>] [-label <build name>] [-o <results.csv>]\n", program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    int runs = 5;
+    double scale = 1.0;
+    char* label = "";
+    char* output_file_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) usage(argv[0]);
+        if (strcmp(argv[i], "-runs") == 0) runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-scale") == 0) scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "-label") == 0) label = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0) output_file_name = argv[++i];
+        else usage(argv[0]);
+    }
+    if (runs < 1 || runs > BENCH_MAX_RUNS || scale <= 0) usage(argv[0]);
+
+    FILE* output = NULL;
+    if (output_file_name != NULL) {
+        output = fopen(output_file_name, "w");
+        if (output == NULL) {
+            printf("[ERROR] could not open `%s`\n", output_file_name);
+            return 1;
+        }
+        fprintf(output, "label,workload,engine,instructions,runs,best_seconds,median_seconds,best_mips,median_mips\n");
+    }
+
+    bool failed = false;
+    printf("%-10s %-10s %12s %10s %10s\n", "workload", "engine", "instructions", "best MIPS", "median");
+    for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+        double outer = workloads[w].outer * scale;
+        Program program = {0};
+        workloads[w].build(&program, outer < 1 ? 1 : outer > 0xFFFF ? 0xFFFF : (uWord)outer);
+        Outcome expected = {0};
+        for (size_t e = 0; e < ENGINE_NAME_COUNT; e++) {
+            Outcome outcome;
+            run_program(&program, engine_names[e].engine, &outcome); // warmup
+            double seconds[BENCH_MAX_RUNS];
+            for (int r = 0; r < runs; r++) seconds[r] = run_program(&program, engine_names[e].engine, &outcome);
+            qsort(seconds, runs, sizeof(seconds[0]), compare_doubles);
+            double best = seconds[0];
+            double median = seconds[runs / 2];
+            double instructions = (double)outcome.icount;
+            printf("%-10s %-10s %12llu %10.1f %10.1f\n", workloads[w].name, engine_names[e].name,
+                   (unsigned long long)outcome.icount, instructions / best * 1e-6, instructions / median * 1e-6);
+            if (output != NULL) {
+                fprintf(output, "%s,%s,%s,%llu,%d,%.6f,%.6f,%.2f,%.2f\n", label, workloads[w].name, engine_names[e].name,
+                        (unsigned long long)outcome.icount, runs, best, median,
+                        instructions / best * 1e-6, instructions / median * 1e-6);
+            }
+            if (outcome.reason != STOP_HALTED) {
+                printf("[ERROR] %s on %s stopped with %s\n", workloads[w].name, engine_names[e].name, stop_reason_name[outcome.reason]);
+                failed = true;
+            }
+            if (e == 0) {
+                expected = outcome;
+            } else if (outcome.icount != expected.icount || outcome.checksum != expected.checksum) {
+                printf("[ERROR] %s on %s does not match %s\n", workloads[w].name, engine_names[e].name, engine_names[0].name);
+                failed = true;
+            }
+        }
+    }
+    if (output != NULL) fclose(output);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,423 @@
+// differential fuzzer for the engines: random programs on random machine
+// states, run on an engine and on the reference path (the op_* functions
+// behind `execute_instruction_masked`) in lockstep. after every slice the
+// registers, PC, PSR, SSP, instruction count, stop reason, console output
+// and the memory pages either side wrote are compared, and an input that
+// tells them apart is shrunk down and written out so it can be rerun
+//
+// gcc -O2 ./emulator/fuzz_engines.c -o ./fuzz_engines
+// ./fuzz_engines [-cases <n>] [-seed <n>] [-steps <n>] [-engine <name>] [-o <failure.bin>] [inputs...]
+//
+// with inputs it only runs those, a failure written out earlier for one.
+// building with -DVBOY_LIBFUZZER gives a libFuzzer target instead of `main`:
+// clang -O1 -g -fsanitize=fuzzer,address -DVBOY_LIBFUZZER ./emulator/fuzz_engines.c -o ./fuzz_engines
+//
+// an input is a header and then the program, all little endian:
+//   u32 seed    fills the rest of memory, trap and interrupt vectors included
+//   u16 r0-r7
+//   u16 psr     taken as is, flags that are not one of n, z or p too
+//   u16 ssp
+//   u8  slice   how many instructions the engine gets per call, 1 + slice,
+//               JIT_MAX_BLOCK_LEN + slice for the jit, which only runs
+//               blocks with a budget that big
+//   u16 words   loaded at MEM_USERSPC_BEGIN, where PC starts
+// the machine has no devices and the keyboard is at end of input
+#define VBOY_NO_MAIN
+#include "virtual_boy.c"
+
+#define FUZZ_HEADER_SIZE 25
+#define FUZZ_MAX_WORDS   1024
+#define FUZZ_MAX_INPUT   (FUZZ_HEADER_SIZE + FUZZ_MAX_WORDS * 2)
+
+static uint64_t max_steps = 4096; // instructions per case
+static uint64_t compared = 0;     // instructions both sides ran, over all cases
+
+typedef struct {
+    uint32_t seed;
+    uWord registers[8];
+    uWord psr;
+    uWord ssp;
+    uint8_t slice;
+    uWord words[FUZZ_MAX_WORDS];
+    size_t count;
+} Fuzz_Case;
+
+uWord read_le16(const uint8_t* bytes) {
+    return bytes[0] | bytes[1] << 8;
+}
+
+// short inputs read as zeros past their end, anything past FUZZ_MAX_WORDS is dropped
+Fuzz_Case parse_case(const uint8_t* data, size_t size) {
+    uint8_t header[FUZZ_HEADER_SIZE] = {0};
+    memcpy(header, data, size < FUZZ_HEADER_SIZE ? size : FUZZ_HEADER_SIZE);
+    Fuzz_Case c = {0};
+    c.seed = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t)header[3] << 24;
+    for (int i = 0; i < 8; i++) c.registers[i] = read_le16(&header[4 + i * 2]);
+    c.psr = read_le16(&header[20]);
+    c.ssp = read_le16(&header[22]);
+    c.slice = header[24];
+    if (size > FUZZ_HEADER_SIZE) {
+        c.count = (size - FUZZ_HEADER_SIZE) / 2;
+        if (c.count > FUZZ_MAX_WORDS) c.count = FUZZ_MAX_WORDS;
+        for (size_t i = 0; i < c.count; i++) c.words[i] = read_le16(&data[FUZZ_HEADER_SIZE + i * 2]);
+    }
+    return c;
+}
+
+size_t format_case(const Fuzz_Case* c, uint8_t* data) {
+    memset(data, 0, FUZZ_HEADER_SIZE);
+    for (int i = 0; i < 4; i++) data[i] = c->seed >> (i * 8);
+    uWord header_words[10];
+    memcpy(header_words, c->registers, sizeof(c->registers));
+    header_words[8] = c->psr;
+    header_words[9] = c->ssp;
+    for (int i = 0; i < 10; i++) {
+        data[4 + i * 2] = header_words[i] & 0xFF;
+        data[5 + i * 2] = header_words[i] >> 8;
+    }
+    data[24] = c->slice;
+    for (size_t i = 0; i < c->count; i++) {
+        data[FUZZ_HEADER_SIZE + i * 2] = c->words[i] & 0xFF;
+        data[FUZZ_HEADER_SIZE + i * 2 + 1] = c->words[i] >> 8;
+    }
+    return FUZZ_HEADER_SIZE + c->count * 2;
+}
+
+// what both sides fork their memory off, so only the pages they wrote
+// stop being shared. the seed always fills it the same way
+Memory case_memory(const Fuzz_Case* c) {
+    Memory memory = init_memory();
+    uint32_t state = c->seed | 1;
+    for (size_t i = 0; i < MEMORY_SIZE; i++) poke_memory(memory, i, next_random(&state));
+    return memory;
+}
+
+static const Byte_Data no_input = {0};
+
+Machine case_machine(const Fuzz_Case* c, Memory memory, Console* console) {
+    Machine machine = init_machine();
+    boot_words(&machine, memory, c->words, c->count);
+    for (int i = 0; i < 8; i++) machine.registers[i] = c->registers[i];
+    machine.PSR = c->psr;
+    machine.SSP = c->ssp;
+    machine.console = console;
+    machine.input = &no_input;
+    return machine;
+}
+
+// one instruction on the reference path, with the stops `run` makes around it
+Stop_Reason reference_step(Machine* machine, Memory memory) {
+    if (read_memory(memory, MACHINE_CONTROL_REGISTER) == 0) return STOP_HALTED;
+    if (machine->PC + 1 >= MEM_END) return STOP_END_OF_MEMORY;
+    uWord pc = machine->PC;
+    Instruction inst = read_memory(memory, pc);
+    machine->PC++;
+    machine->icount++;
+    if (inst >> 12 == Op_RES) return STOP_ILLEGAL_OPCODE;
+    execute_instruction_masked(machine, inst, memory);
+    if (inst >> 12 == Op_BR && machine->PC == pc) {
+        // a taken branch to itself, the engines stop in front of it
+        machine->PC = pc;
+        machine->icount--;
+        return STOP_IDLE;
+    }
+    // everything that can clear the MCR is a store, which `run` looks at right after
+    if (read_memory(memory, MACHINE_CONTROL_REGISTER) == 0) return STOP_HALTED;
+    return STOP_BUDGET;
+}
+
+typedef struct {
+    Machine machine;
+    Memory memory;
+    Console console;
+    Stop_Reason reason;
+} Side;
+
+// the first difference between the two sides, false when there is none
+bool describe_difference(const Side* reference, const Side* engine, char* what, size_t size) {
+    const Machine* a = &reference->machine;
+    const Machine* b = &engine->machine;
+    if (a->icount != b->icount) {
+        snprintf(what, size, "icount %llu, engine %llu", (unsigned long long)a->icount, (unsigned long long)b->icount);
+        return true;
+    }
+    if (reference->reason != engine->reason) {
+        snprintf(what, size, "stop %s, engine %s", stop_reason_name[reference->reason], stop_reason_name[engine->reason]);
+        return true;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (a->registers[i] != b->registers[i]) {
+            snprintf(what, size, "r%d x%04X, engine x%04X", i, (uWord)a->registers[i], (uWord)b->registers[i]);
+            return true;
+        }
+    }
+    if (a->PC != b->PC) {
+        snprintf(what, size, "PC x%04X, engine x%04X", a->PC, b->PC);
+        return true;
+    }
+    if (read_psr(a) != read_psr(b)) {
+        snprintf(what, size, "PSR x%04X, engine x%04X", read_psr(a), read_psr(b));
+        return true;
+    }
+    if (a->SSP != b->SSP) {
+        snprintf(what, size, "SSP x%04X, engine x%04X", a->SSP, b->SSP);
+        return true;
+    }
+    const Byte_Data* out_a = &reference->console.buffer;
+    const Byte_Data* out_b = &engine->console.buffer;
+    if (out_a->count != out_b->count || memcmp(out_a->bytes, out_b->bytes, out_a->count) != 0) {
+        snprintf(what, size, "%zu bytes of output, engine %zu or different ones", out_a->count, out_b->count);
+        return true;
+    }
+    return false;
+}
+
+// the pages either side wrote since the last call, found by their no longer
+// being shared. pages that match are shared again, so the next call only
+// looks at the ones written after it
+bool describe_memory_difference(Side* reference, Side* engine, char* what, size_t size) {
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        Page* page_a = reference->memory->pages[i];
+        Page* page_b = engine->memory->pages[i];
+        if (page_a == page_b) continue;
+        if (memcmp(page_a->words, page_b->words, sizeof(page_a->words)) == 0) {
+            retain_page(page_a);
+            release_page(page_b);
+            map_page(reference->memory, i, page_a, false);
+            map_page(engine->memory, i, page_a, false);
+            continue;
+        }
+        for (int j = 0; j < PAGE_WORDS; j++) {
+            if (page_a->words[j] != page_b->words[j]) {
+                snprintf(what, size, "memory x%04X x%04X, engine x%04X", i * PAGE_WORDS + j, page_a->words[j], page_b->words[j]);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void free_side(Side* side) {
+    free_machine(&side->machine);
+    free_memory(side->memory);
+    free(side->console.buffer.bytes);
+}
+
+// runs the case on `engine` and on the reference path, false and the
+// difference in `what` when they part ways
+bool check_case(const Fuzz_Case* c, Engine engine, char* what, size_t size) {
+    Memory memory = case_memory(c);
+    Side reference = { .memory = fork_memory(memory), .console = init_console(NULL) };
+    Side tested = { .memory = fork_memory(memory), .console = init_console(NULL) };
+    free_memory(memory);
+    reference.machine = case_machine(c, reference.memory, &reference.console);
+    tested.machine = case_machine(c, tested.memory, &tested.console);
+    tested.machine.engine = engine;
+
+    uint64_t slice = 1 + c->slice;
+#ifdef JIT_SUPPORTED
+    if (engine == ENGINE_JIT) slice = JIT_MAX_BLOCK_LEN + c->slice;
+#endif
+    bool same = true;
+    while (tested.machine.icount < max_steps) {
+        uint64_t before = tested.machine.icount;
+        tested.reason = run(&tested.machine, tested.memory, slice);
+        reference.reason = STOP_BUDGET;
+        while (reference.reason == STOP_BUDGET && reference.machine.icount < tested.machine.icount) {
+            reference.reason = reference_step(&reference.machine, reference.memory);
+        }
+        // the stops in front of an instruction, nothing retired for them
+        if (tested.reason != STOP_BUDGET && reference.reason == STOP_BUDGET) {
+            reference.reason = reference_step(&reference.machine, reference.memory);
+        }
+        // the emulator keeps going after an illegal opcode
+        if (reference.reason == STOP_ILLEGAL_OPCODE && tested.reason == STOP_ILLEGAL_OPCODE) {
+            reference.reason = tested.reason = STOP_BUDGET;
+        }
+        if (describe_difference(&reference, &tested, what, size) ||
+            describe_memory_difference(&reference, &tested, what, size)) {
+            same = false;
+            break;
+        }
+        if (tested.reason != STOP_BUDGET || tested.machine.icount == before) break;
+    }
+    compared += reference.machine.icount;
+    free_side(&reference);
+    free_side(&tested);
+    return same;
+}
+
+// fails on some engine, the index of the first in `failing`
+bool case_fails(const Fuzz_Case* c, int only_engine, int* failing, char* what, size_t size) {
+    for (size_t e = 0; e < ENGINE_NAME_COUNT; e++) {
+        if (only_engine >= 0 && (int)e != only_engine) continue;
+        if (!check_case(c, engine_names[e].engine, what, size)) {
+            *failing = e;
+            return true;
+        }
+    }
+    return false;
+}
+
+// greedy shrinking on one engine: drop runs of words while it still fails,
+// halving the run length, then turn words into BR with no condition (a nop)
+// and clear the registers one at a time
+Fuzz_Case minimize_case(Fuzz_Case c, Engine engine) {
+    char what[128];
+    for (size_t run = c.count / 2; run > 0; run /= 2) {
+        for (size_t at = 0; at + run <= c.count;) {
+            Fuzz_Case smaller = c;
+            memmove(&smaller.words[at], &smaller.words[at + run], (c.count - at - run) * sizeof(uWord));
+            smaller.count -= run;
+            if (!check_case(&smaller, engine, what, sizeof(what))) c = smaller;
+            else at += run;
+        }
+    }
+    for (size_t i = 0; i < c.count; i++) {
+        if (c.words[i] == 0) continue;
+        Fuzz_Case simpler = c;
+        simpler.words[i] = 0;
+        if (!check_case(&simpler, engine, what, sizeof(what))) c = simpler;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (c.registers[i] == 0) continue;
+        Fuzz_Case simpler = c;
+        simpler.registers[i] = 0;
+        if (!check_case(&simpler, engine, what, sizeof(what))) c = simpler;
+    }
+    if (c.slice != 0) {
+        Fuzz_Case simpler = c;
+        simpler.slice = 0;
+        if (!check_case(&simpler, engine, what, sizeof(what))) c = simpler;
+    }
+    return c;
+}
+
+#ifdef VBOY_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    Fuzz_Case c = parse_case(data, size);
+    char what[128];
+    int failing;
+    if (case_fails(&c, -1, &failing, what, sizeof(what))) {
+        printf("[ERROR] %s differs from the reference: %s\n", engine_names[failing].name, what);
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+// random words, with most of the illegal opcodes rolled again so cases get
+// further than a few instructions
+Fuzz_Case random_case(uint32_t* state) {
+    Fuzz_Case c = {0};
+    c.seed = next_random(state);
+    for (int i = 0; i < 8; i++) c.registers[i] = next_random(state);
+    c.psr = next_random(state);
+    c.ssp = next_random(state);
+    c.slice = next_random(state) % 4 == 0 ? next_random(state) : 0;
+    c.count = 1 + next_random(state) % 64;
+    for (size_t i = 0; i < c.count; i++) {
+        uWord word = next_random(state);
+        while (word >> 12 == Op_RES && next_random(state) % 4 != 0) word = next_random(state);
+        c.words[i] = word;
+    }
+    return c;
+}
+
+// shrinks a failing case, prints it and writes it to `output_file_name`
+void report_failure(const Fuzz_Case* c, int engine, const char* output_file_name) {
+    char what[128];
+    Fuzz_Case small = minimize_case(*c, engine_names[engine].engine);
+    check_case(&small, engine_names[engine].engine, what, sizeof(what));
+    printf("[ERROR] %s differs from the reference: %s\n", engine_names[engine].name, what);
+    printf("seed x%08X, slice %d, psr x%04X, ssp x%04X\n", small.seed, small.slice, small.psr, small.ssp);
+    printf("registers:");
+    for (int i = 0; i < 8; i++) printf(" x%04X", small.registers[i]);
+    printf("\nprogram:");
+    for (size_t i = 0; i < small.count; i++) printf(" x%04X", small.words[i]);
+    printf("\n");
+
+    uint8_t data[FUZZ_MAX_INPUT];
+    size_t size = format_case(&small, data);
+    FILE* file = fopen(output_file_name, "wb");
+    if (file == NULL || fwrite(data, 1, size, file) != size) {
+        printf("[ERROR] could not write `%s`\n", output_file_name);
+    } else {
+        printf("written to `%s`\n", output_file_name);
+    }
+    if (file != NULL) fclose(file);
+}
+
+void usage(char* program) {
+    printf("Usage: %s [-cases <n>] [-seed <n>] [-steps <n>] [-engine <name>] [-o <failure.bin>] [inputs...]\n", program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    uint64_t cases = 10000;
+    uint32_t seed = 1;
+    int only_engine = -1;
+    char* output_file_name = "fuzz_failure.bin";
+    int first_input = argc;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            first_input = i;
+            break;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        if (strcmp(argv[i], "-cases") == 0) cases = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-seed") == 0) seed = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-steps") == 0) max_steps = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-o") == 0) output_file_name = argv[++i];
+        else if (strcmp(argv[i], "-engine") == 0) {
+            char* name = argv[++i];
+            for (size_t e = 0; e < ENGINE_NAME_COUNT; e++) {
+                if (strcmp(name, engine_names[e].name) == 0) only_engine = e;
+            }
+            if (only_engine < 0) {
+                printf("[ERROR] unknown engine `%s`\n", name);
+                return 1;
+            }
+        } else usage(argv[0]);
+    }
+
+    char what[128];
+    int failing;
+    if (first_input < argc) {
+        bool failed = false;
+        for (int i = first_input; i < argc; i++) {
+            FILE* file = fopen(argv[i], "rb");
+            if (file == NULL) {
+                printf("[ERROR] could not open `%s`\n", argv[i]);
+                return 1;
+            }
+            uint8_t data[FUZZ_MAX_INPUT];
+            size_t size = fread(data, 1, sizeof(data), file);
+            fclose(file);
+            Fuzz_Case c = parse_case(data, size);
+            if (case_fails(&c, only_engine, &failing, what, sizeof(what))) {
+                printf("%s: %s differs from the reference: %s\n", argv[i], engine_names[failing].name, what);
+                failed = true;
+            } else {
+                printf("%s: ok\n", argv[i]);
+            }
+        }
+        return failed ? 1 : 0;
+    }
+
+    uint32_t state = seed != 0 ? seed : 1;
+    for (uint64_t n = 0; n < cases; n++) {
+        Fuzz_Case c = random_case(&state);
+        if (case_fails(&c, only_engine, &failing, what, sizeof(what))) {
+            printf("case %llu of seed %u\n", (unsigned long long)n, seed);
+            report_failure(&c, failing, output_file_name);
+            return 1;
+        }
+    }
+    printf("%llu cases, %llu instructions, no differences\n", (unsigned long long)cases, (unsigned long long)compared);
+    return 0;
+}
+
+#endif // VBOY_LIBFUZZER
@@ -0,0 +1,137 @@
+// startup benchmark: starts `vboy` over and over on a program that halts
+// right away and reports the time from before the process is spawned to its
+// first instruction (vboy's `-startup-clock`) and to the process exiting,
+// best and median over `-runs`. it runs without an os, with the os read from
+// a file and with the built in one
+//
+// gcc -O2 ./emulator/startup_bench.c -o ./startup_bench
+// ./startup_bench [-vboy <path>] [-os <os.bin>] [-runs <n>]
+#define VBOY_NO_MAIN
+#include "virtual_boy.c"
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+#define STARTUP_MAX_RUNS 10000
+
+extern char** environ;
+
+typedef struct {
+    const char* name;
+    const char* os; // NULL for none
+} Startup_Config;
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// one start of vboy, false when it did not report its startup time
+bool startup_run(char* vboy, const char* os, char* program, uint64_t* to_first, uint64_t* to_exit) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+
+    char clock[32];
+    char* argv[10];
+    int argc = 0;
+    argv[argc++] = vboy;
+    if (os != NULL) {
+        argv[argc++] = "-os";
+        argv[argc++] = (char*)os;
+    }
+    argv[argc++] = "-b";
+    argv[argc++] = program;
+    argv[argc++] = "-startup-clock";
+    argv[argc++] = clock;
+    argv[argc] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+    uint64_t start = now_nanoseconds();
+    snprintf(clock, sizeof(clock), "%llu", (unsigned long long)start);
+    pid_t pid;
+    int failed = posix_spawn(&pid, vboy, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (failed != 0) {
+        close(fds[0]);
+        printf("[ERROR] could not start `%s`\n", vboy);
+        return false;
+    }
+
+    char output[256];
+    size_t count = 0;
+    ssize_t got;
+    while (count < sizeof(output) - 1 && (got = read(fds[0], output + count, sizeof(output) - 1 - count)) > 0) count += got;
+    output[count] = '\0';
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    *to_exit = now_nanoseconds() - start;
+
+    unsigned long long ns;
+    char* line = strstr(output, "startup: ");
+    if (line == NULL || sscanf(line, "startup: %llu ns", &ns) != 1) {
+        printf("[ERROR] `%s` did not report its startup time:\n%s", vboy, output);
+        return false;
+    }
+    *to_first = ns;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    char* vboy = "./vboy";
+    char* os = "./os.bin";
+    int runs = 200;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-vboy") == 0 && i + 1 < argc) {
+            vboy = argv[++i];
+        } else if (strcmp(argv[i], "-os") == 0 && i + 1 < argc) {
+            os = argv[++i];
+        } else if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [-vboy <path>] [-os <os.bin>] [-runs <n>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (runs > STARTUP_MAX_RUNS) runs = STARTUP_MAX_RUNS;
+
+    // TRAP x25 at 0x3000
+    char program[] = "/tmp/startup_bench_XXXXXX";
+    int fd = mkstemp(program);
+    if (fd < 0 || write(fd, "\x25\xF0", 2) != 2) {
+        printf("[ERROR] could not write the program\n");
+        return 1;
+    }
+    close(fd);
+
+    const Startup_Config configs[] = {
+        { "no os",    NULL },
+        { "os file",  os },
+        { "stock os", "stock" },
+    };
+    static uint64_t to_first[STARTUP_MAX_RUNS];
+    static uint64_t to_exit[STARTUP_MAX_RUNS];
+    bool ok = true;
+    printf("%-10s %14s %14s %14s %14s\n", "", "first best", "first median", "exit best", "exit median");
+    for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]) && ok; c++) {
+        startup_run(vboy, configs[c].os, program, &to_first[0], &to_exit[0]); // warmup
+        for (int run = 0; run < runs && ok; run++) {
+            ok = startup_run(vboy, configs[c].os, program, &to_first[run], &to_exit[run]);
+        }
+        if (!ok) break;
+        qsort(to_first, runs, sizeof(*to_first), compare_u64);
+        qsort(to_exit, runs, sizeof(*to_exit), compare_u64);
+        printf("%-10s %11.1f us %11.1f us %11.1f us %11.1f us\n", configs[c].name,
+               to_first[0] / 1e3, to_first[runs / 2] / 1e3, to_exit[0] / 1e3, to_exit[runs / 2] / 1e3);
+    }
+    unlink(program);
+    return ok ? 0 : 1;
+}
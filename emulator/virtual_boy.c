@@ -1,21 +1,75 @@
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <threads.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#if defined(__unix__)
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#define HOST_IO_SUPPORTED 1
+#endif
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED 1
+#endif
+
+// the stock os.bin, built in so `-os stock` needs no file. after changing
+// os.s regenerate it with `xxd -i -n stock_os os.bin > emulator/stock_os.h`
+#include "stock_os.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 typedef uint16_t uWord;
 typedef int16_t   Word;
 
-#define MEMORY_SIZE 65535
+#define MEMORY_SIZE 0x10000
 
+// the -debug session with its timeline, watchpoints and breakpoint
+// conditions. -D_DEBUGGER=0 builds without any of it
+#ifndef _DEBUGGER
 #define _DEBUGGER 1
+#endif
+
+// guest memory is split into pages that are reference counted and shared
+// copy on write, so forking a machine or taking a snapshot only costs a page
+// table. a page is only written in place while its `writable` bit is set,
+// the bit is clear while the page is shared and the first store copies it
+#define PAGE_BITS  8
+#define PAGE_WORDS (1 << PAGE_BITS)
+#define PAGE_MASK  (PAGE_WORDS - 1)
+#define PAGE_COUNT (MEMORY_SIZE / PAGE_WORDS)
+
+typedef struct {
+    _Atomic uint32_t refcount;
+    uWord words[PAGE_WORDS]; // [ALERT] cant use signed char instead of uint8 
+    //                       // as signed char get sign extended by C which messes with the data
+    //                       // could also use `unsigned char`
+} Page;
+
+#define WRITABLE_WORD_BITS 64
 
-typedef uint16_t Memory[MEMORY_SIZE]; // [ALERT] cant use signed char instead of uint8 
-//                                      // as signed char get sign extended by C which messes with the data
-//                                      // could also use `unsigned char`
+// kept small on purpose, this is all a fork costs besides the pages it copies
+typedef struct {
+    Page*    pages[PAGE_COUNT];
+    uint64_t writable[PAGE_COUNT / WRITABLE_WORD_BITS]; // see `writable_page`
+} Guest_Memory;
+
+typedef Guest_Memory* Memory;
 
 // memory layout:
 // Trap Vector Table      : 0x0000 - 0x00FF
@@ -50,6 +104,8 @@ typedef uWord Instruction;
 #define PSR_BIT_N   (1 << 0)
 #define PSR_BIT_Z   (1 << 1)
 #define PSR_BIT_P   (1 << 2)
+#define PSR_PRIORITY_SHIFT 8
+#define PSR_PRIORITY_MASK  (0b111 << PSR_PRIORITY_SHIFT)
 
 #define VEC_PRIV_MODE_VIOLATION (0x0 + MEM_INTERVT_BEGIN)
 #define VEC_ILLEGAL_OPCODE      (0x1 + MEM_INTERVT_BEGIN)
@@ -92,22 +148,182 @@ static char* op_name[] = {
     [Op_TRAP] = "Op_TRAP",
 };
 
+// predecoded form of an instruction word, the operand fields are pulled out
+// and the offsets sign extended once so the run loop doesnt have to
+typedef enum {
+    DEC_MISS = 0, // not decoded yet, or invalidated by a store
+    DEC_BR,
+    DEC_ADD_REG,
+    DEC_ADD_IMM,
+    DEC_LD,
+    DEC_ST,
+    DEC_JSR,
+    DEC_JSRR,
+    DEC_AND_REG,
+    DEC_AND_IMM,
+    DEC_LDR,
+    DEC_STR,
+    DEC_RTI,
+    DEC_NOT,
+    DEC_LDI,
+    DEC_STI,
+    DEC_JMP,
+    DEC_RES,
+    DEC_LEA,
+    DEC_TRAP,
+    DEC_SPIN,          // a BR to itself, see `run_decode`
+    DEC_BREAKPOINT,    // not an instruction, see `set_breakpoint`
+    DEC_END_OF_MEMORY, // not an instruction, PC ran into the last two words
+    DEC_COUNT,
+} Dec_Kind;
+
 typedef struct {
-    Word  registers[8];
-    uWord PC;
-    uWord IR;
-    uWord PSR;
-    uWord SSP;
-    uint8_t intv;
-    uint8_t int_sig;
-} Machine;
+    uint8_t kind;
+    uint8_t r0;   // DR, or SR for the stores
+    uint8_t r1;   // SR1 / BaseR
+    uint8_t r2;   // SR2, or the nzp mask for BR (already in PSR bit order)
+    int16_t imm;  // sign extended imm/offset, the raw 12 bits for TRAP and RTI
+} Decoded;
+
+typedef struct Jit Jit;
+typedef struct Io_Map Io_Map;
+typedef struct Profile Profile;
+typedef struct Trace Trace;
+typedef struct Timeline Timeline;
+typedef struct Debugger Debugger;
+
+typedef enum {
+    ENGINE_DECODE,
+    ENGINE_THREADED,
+    ENGINE_JIT,
+    ENGINE_AOT, // code generated ahead of time by aot.c, see `Machine.translated`
+} Engine;
+
+// why `run` gave control back
+typedef enum {
+    STOP_HALTED,          // MCR was cleared, TRAP x25 or a store to 0xFFFE
+    STOP_BUDGET,          // ran the number of instructions it was asked to
+    STOP_ILLEGAL_OPCODE,  // PC is just past the offending instruction
+    STOP_BREAKPOINT,      // PC is on the breakpoint, the instruction has not run
+    STOP_END_OF_MEMORY,   // PC reached 0xFFFE
+    STOP_IDLE,            // PC is on a taken branch to itself, nothing could ever get it out
+    STOP_TRACE_END,       // the replayed trace is over, or the run no longer matches it
+    STOP_WATCHPOINT,      // PC is on a load or store of a watched address, the instruction has not run
+} Stop_Reason;
+
+static char* stop_reason_name[] = {
+    [STOP_HALTED] = "STOP_HALTED",
+    [STOP_BUDGET] = "STOP_BUDGET",
+    [STOP_ILLEGAL_OPCODE] = "STOP_ILLEGAL_OPCODE",
+    [STOP_BREAKPOINT] = "STOP_BREAKPOINT",
+    [STOP_END_OF_MEMORY] = "STOP_END_OF_MEMORY",
+    [STOP_IDLE] = "STOP_IDLE",
+    [STOP_TRACE_END] = "STOP_TRACE_END",
+    [STOP_WATCHPOINT] = "STOP_WATCHPOINT",
+};
+
+// the engines `-engine` and the tools pick by name. ENGINE_AOT only runs
+// code aot.c generated, so it has none
+const struct {
+    char* name;
+    Engine engine;
+} engine_names[] = {
+    { "decode",   ENGINE_DECODE },
+    { "threaded", ENGINE_THREADED },
+#ifdef JIT_SUPPORTED
+    { "jit",      ENGINE_JIT },
+#endif
+};
+
+#define ENGINE_NAME_COUNT (sizeof(engine_names) / sizeof(engine_names[0]))
+
+bool find_engine(const char* name, Engine* engine) {
+    for (size_t i = 0; i < ENGINE_NAME_COUNT; i++) {
+        if (strcmp(name, engine_names[i].name) != 0) continue;
+        *engine = engine_names[i].engine;
+        return true;
+    }
+    return false;
+}
+
+// the stops at PC that were already reported, see `run`. a breakpoint is
+// looked at before a watchpoint, so resuming from a watchpoint skips both
+#define RESUME_BREAKPOINT 1
+#define RESUME_WATCHPOINT 2
+
+#define RUN_FOREVER UINT64_MAX
 
 typedef struct {
     uint8_t* bytes;
     size_t capacity; 
     size_t count; 
+    bool mapped; // the bytes are a `load_image` mapping, see `free_image`
 } Byte_Data;
 
+typedef struct Host_Io Host_Io;
+
+// guest console output is collected here and handed to stdio in chunks,
+// instead of one putc per TRAP_OUT. see `console_flush` for when it goes out
+typedef struct {
+    Byte_Data buffer;
+    FILE* file;             // NULL keeps everything in `buffer`, for capturing output
+    Host_Io* host;          // when set the chunks go to the device thread instead of `file`
+    bool flush_on_newline;  // set when `file` is a terminal
+    uint64_t bytes;         // bytes the guest wrote
+    uint64_t flushes;
+} Console;
+
+// interrupt sources, see `interrupt_sources` for their vectors and priorities
+typedef enum {
+    INT_TIMER,
+    INT_KEYBOARD,
+    INT_COUNT,
+} Interrupt_Source;
+
+// things that happen after a number of instructions, see `schedule_event`
+typedef enum {
+    EVENT_TIMER,
+    EVENT_KEYBOARD,
+    EVENT_COUNT,
+} Event_Kind;
+
+#define EVENT_NEVER UINT64_MAX
+
+typedef struct Machine {
+    Word  registers[8];
+    uWord PC;
+    uWord IR;
+    uWord PSR;
+    uWord SSP;
+    uint8_t int_pending;      // a bit per Interrupt_Source raised and not taken yet
+    uint8_t rescheduled;      // a bit per Event_Kind with a new `delay` that is not in `deadline` yet
+    bool idle;                // the last slice ended spinning on a DEC_SPIN
+    uint64_t deadline[EVENT_COUNT]; // icount each event fires at, EVENT_NEVER when it is off
+    uint64_t delay[EVENT_COUNT];
+    uint64_t next_event;      // the earliest deadline, `run` never lets an engine run past it
+    uint32_t cc_result; // last flag setting result, or CC_IN_PSR, see `sync_flags`
+    Decoded* decoded; // one entry per address, see `decode_instruction`
+    Jit* jit;         // created by the first `run_jit`
+    Engine engine;
+    Stop_Reason (*translated)(struct Machine* machine, Memory memory, uint64_t max_instructions); // ENGINE_AOT
+    uint64_t icount;  // retired instructions
+    bool event;       // something `run` has to look at before the next instruction
+    bool hle;         // run the stock os trap routines natively, see `hle_trap`
+    Profile* profile; // execution counters, NULL when not profiling, see `run_instrumented`
+    Trace* trace;     // recording or replaying a trace, see `record_retire`
+#if _DEBUGGER
+    Timeline* timeline; // snapshots and write history for -debug, see `timeline_run`
+    Debugger* debugger; // watchpoints and breakpoint conditions, see `hits_watchpoint`
+#endif
+    uint64_t* breakpoints; // bitmap over the address space, NULL when there are none
+    uint8_t resuming;      // RESUME_BREAKPOINT | RESUME_WATCHPOINT, `run` goes through those at PC
+    Console* console;        // TRAP_OUT goes here instead of straight to stdout when set
+    Io_Map* io;              // devices in the I/O page, NULL when there are none
+    const Byte_Data* input;  // TRAP_GETC reads from here instead of stdin when set
+    size_t input_pos;
+    Host_Io* host;           // stdin comes from the device thread when set, see `update_device`
+} Machine;
+
 Byte_Data init_byte_data_size(size_t size) {
     Byte_Data byte_data = {0};
     byte_data.count = 0;
@@ -133,15 +349,49 @@ void push_data(Byte_Data* byte_data, uWord data) {
     byte_data->count++;
 }
 
-void print_machine_state(const Machine* machine) {
+// condition codes are evaluated lazily: instructions that set them only
+// record their result in `cc_result`, and the N Z P bits of PSR are worked
+// out from it when something actually looks at them (BR, pushing PSR, the
+// state dump). CC_IN_PSR means the bits in PSR are already up to date
+#define CC_IN_PSR 0x10000
+
+#define PSR_NZP_MASK 0b0000000000000111
+
+uWord flags_from_result(Word result) {
+    if (result == 0) return 0b0000000000000010;
+    if (result < 0)  return 0b0000000000000100;
+    return 0b0000000000000001;
+}
+
+uWord read_flags(const Machine* machine) {
+    if (machine->cc_result == CC_IN_PSR) return machine->PSR & PSR_NZP_MASK;
+    return flags_from_result((Word)machine->cc_result);
+}
+
+uWord read_psr(const Machine* machine) {
+    return (machine->PSR & ~PSR_NZP_MASK) | read_flags(machine);
+}
+
+// call before PSR is read or written as a whole
+void sync_flags(Machine* machine) {
+    machine->PSR = read_psr(machine);
+    machine->cc_result = CC_IN_PSR;
+}
+
+void fprint_machine_state(FILE* file, const Machine* machine) {
+    uWord psr = read_psr(machine);
     for (int i = 0; i < 8; i++) {
-        printf("R%d:%d\n", i, (int16_t)machine->registers[i]);
+        fprintf(file, "R%d:%d\n", i, (int16_t)machine->registers[i]);
     }
-    printf("PC:0x%x\n", machine->PC);
-    printf("PSR:%d\n", machine->PSR);
-    printf("n:%d ",  (machine->PSR & 0b0000000000000001) != 0);
-    printf("z:%d ",  (machine->PSR & 0b0000000000000010) != 0);
-    printf("p:%d\n", (machine->PSR & 0b0000000000000100) != 0);
+    fprintf(file, "PC:0x%x\n", machine->PC);
+    fprintf(file, "PSR:%d\n", psr);
+    fprintf(file, "n:%d ",  (psr & 0b0000000000000001) != 0);
+    fprintf(file, "z:%d ",  (psr & 0b0000000000000010) != 0);
+    fprintf(file, "p:%d\n", (psr & 0b0000000000000100) != 0);
+}
+
+void print_machine_state(const Machine* machine) {
+    fprint_machine_state(stdout, machine);
 }
 
 int16_t sext(int val, size_t size) {
@@ -153,21 +403,8 @@ int16_t sext(int val, size_t size) {
     return res;
 }
 
-void set_flags(Machine* machine, bool n, bool z, bool p) {
-    if (n) machine->PSR |= 0b0000000000000100; 
-    else   machine->PSR &= 0b1111111111111011;
-
-    if (z) machine->PSR |= 0b0000000000000010;
-    else   machine->PSR &= 0b1111111111111101;
-
-    if (p) machine->PSR |= 0b0000000000000001;
-    else   machine->PSR &= 0b1111111111111110;
-}
-
 void set_flags_from_result(Machine* machine, Word result) {
-    if (result == 0) set_flags(machine, 0, 1, 0);
-    else if ((result & 0b1000000000000000) == 0) set_flags(machine, 0, 0, 1);
-    else set_flags(machine, 1, 0, 0); 
+    machine->cc_result = (uWord)result;
 }
 
 
@@ -191,6 +428,612 @@ void print_word(uWord word) {
     printf("%s", res);
 }
 
+void jit_invalidate_write(Jit* jit, uWord addr);
+void jit_free(Jit* jit);
+
+// xorshift, the same numbers for the same seed. a seed of 0 only ever gives 0
+uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// every page nobody has written to yet, in every sparse memory. it is never
+// reference counted, so machines on different threads dont fight over it
+static Page zero_page;
+
+Page* alloc_page() {
+    Page* page = malloc(sizeof(*page));
+    atomic_init(&page->refcount, 1);
+    return page;
+}
+
+void retain_page(Page* page) {
+    if (page != &zero_page) atomic_fetch_add(&page->refcount, 1);
+}
+
+void release_page(Page* page) {
+    if (page == &zero_page) return;
+    if (atomic_fetch_sub(&page->refcount, 1) == 1) free(page);
+}
+
+void map_page(Memory memory, int index, Page* page, bool owned) {
+    memory->pages[index] = page;
+    uint64_t bit = (uint64_t)1 << (index % WRITABLE_WORD_BITS);
+    if (owned) memory->writable[index / WRITABLE_WORD_BITS] |= bit;
+    else       memory->writable[index / WRITABLE_WORD_BITS] &= ~bit;
+}
+
+Memory init_memory() {
+    Memory memory = calloc(1, sizeof(*memory));
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        Page* page = alloc_page();
+        memset(page->words, 0, sizeof(page->words));
+        map_page(memory, i, page, true);
+    }
+    return memory;
+}
+
+// the alternative for packing many machines: pages are only allocated on
+// their first write, until then they read from `zero_page`
+Memory init_sparse_memory() {
+    Memory memory = calloc(1, sizeof(*memory));
+    for (int i = 0; i < PAGE_COUNT; i++) map_page(memory, i, &zero_page, false);
+    return memory;
+}
+
+void free_memory(Memory memory) {
+    for (int i = 0; i < PAGE_COUNT; i++) release_page(memory->pages[i]);
+    free(memory);
+}
+
+uWord read_memory(Memory memory, uWord addr) {
+    return memory->pages[addr >> PAGE_BITS]->words[addr & PAGE_MASK];
+}
+
+// the slow half of a store, runs once per page after a fork
+uWord* writable_page(Memory memory, int index) {
+    Page* page = memory->pages[index];
+    if (page == &zero_page) {
+        page = alloc_page();
+        memset(page->words, 0, sizeof(page->words));
+    } else if (atomic_load(&page->refcount) != 1) {
+        Page* copy = alloc_page();
+        memcpy(copy->words, page->words, sizeof(copy->words));
+        release_page(page);
+        page = copy;
+    }
+    map_page(memory, index, page, true);
+    return page->words;
+}
+
+// a store that is not an instruction, for loading images and the like
+void poke_memory(Memory memory, uWord addr, uWord value) {
+    int index = addr >> PAGE_BITS;
+    if ((memory->writable[index / WRITABLE_WORD_BITS] >> (index % WRITABLE_WORD_BITS)) & 1) {
+        memory->pages[index]->words[addr & PAGE_MASK] = value;
+    } else {
+        writable_page(memory, index)[addr & PAGE_MASK] = value;
+    }
+}
+
+// a second Memory sharing every page with `memory`, which gives up its own
+// write access until it copies a page
+Memory fork_memory(Memory memory) {
+    Memory fork = calloc(1, sizeof(*fork));
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        retain_page(memory->pages[i]);
+        fork->pages[i] = memory->pages[i];
+    }
+    for (int i = 0; i < PAGE_COUNT / WRITABLE_WORD_BITS; i++) {
+        if (memory->writable[i] != 0) memory->writable[i] = 0;
+    }
+    return fork;
+}
+
+typedef struct {
+    int resident; // pages with storage behind them, shared or not
+    int private;  // pages only this memory holds, what it adds to the process
+} Page_Usage;
+
+Page_Usage page_usage(Memory memory) {
+    Page_Usage usage = {0};
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        Page* page = memory->pages[i];
+        if (page == &zero_page) continue;
+        usage.resident++;
+        if (atomic_load(&page->refcount) == 1) usage.private++;
+    }
+    return usage;
+}
+
+// execution traces, for -record and -replay. a trace holds every retired PC
+// and the things a run cannot work out by itself: keys from TRAP_GETC, reads
+// of device registers and where interrupts were taken. replaying feeds those
+// back in place of the devices, so the run goes exactly the same way.
+//
+// the file is a header and then blocks, only ever appended to. a block is a
+// little endian u32 with its size once unpacked, a u32 with its size as
+// stored (the same when it did not pack smaller) and then the packed records,
+// see `lz_compress`. a record is one varint, the payload shifted left past a
+// two bit Trace_Tag
+#define TRACE_MAGIC      0x52544256 // "VBTR"
+#define TRACE_VERSION    1
+#define TRACE_BLOCK_SIZE (1 << 16)
+#define TRACE_RECORD_MAX 10         // longest varint
+#define TRACE_FLAG_HLE   (1 << 0)
+
+typedef enum {
+    TRACE_STEPS,     // that many instructions at the PC after the last one
+    TRACE_JUMP,      // one instruction, zigzag PC delta from the PC after the last one
+    TRACE_INPUT,     // a key or a device register read
+    TRACE_INTERRUPT, // an Interrupt_Source taken before the next instruction
+} Trace_Tag;
+
+struct Trace {
+    FILE* file;
+    bool replay;
+    bool failed;       // the replay went another way than the recording
+    uWord next_pc;     // the PC a TRACE_STEPS instruction retires at
+    uint64_t steps;    // recording: not written yet, replay: left in the current record
+    uint64_t retired;
+    size_t used;       // bytes of `block` filled (recording) or read (replay)
+    size_t count;      // replay: bytes in `block`
+    uint8_t block[TRACE_BLOCK_SIZE];
+    uint8_t packed[TRACE_BLOCK_SIZE + TRACE_BLOCK_SIZE / 128 + 16];
+};
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 127)
+#define LZ_HASH_BITS 12
+
+size_t lz_literals(const uint8_t* in, size_t count, uint8_t* out, size_t n) {
+    while (count > 0) {
+        size_t run = count < 128 ? count : 128;
+        out[n++] = run - 1;
+        memcpy(out + n, in, run);
+        n += run;
+        in += run;
+        count -= run;
+    }
+    return n;
+}
+
+// a small lz77 over one block. a token under 0x80 is followed by that many
+// literal bytes plus one, a token from 0x80 up copies (token - 0x80 +
+// LZ_MIN_MATCH) bytes from the 16 bit offset behind it. the copy may overlap
+// what it writes, which is how a loop's records turn into a single token
+size_t lz_compress(const uint8_t* in, size_t count, uint8_t* out) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // position + 1 of the last 4 bytes with this hash
+    size_t n = 0;
+    size_t pos = 0;
+    size_t literal = 0;
+    while (pos + LZ_MIN_MATCH <= count) {
+        uint32_t word;
+        memcpy(&word, in + pos, sizeof(word));
+        uint32_t hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (candidate == 0 || pos - (candidate - 1) > 0xFFFF || memcmp(in + candidate - 1, in + pos, LZ_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        size_t from = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (pos + length < count && length < LZ_MAX_MATCH && in[from + length] == in[pos + length]) length++;
+        n = lz_literals(in + literal, pos - literal, out, n);
+        out[n++] = 0x80 + (length - LZ_MIN_MATCH);
+        out[n++] = (pos - from) & 0xFF;
+        out[n++] = (pos - from) >> 8;
+        pos += length;
+        literal = pos;
+    }
+    return lz_literals(in + literal, count - literal, out, n);
+}
+
+// returns the unpacked size, or 0 when `in` is not a valid block
+size_t lz_decompress(const uint8_t* in, size_t count, uint8_t* out, size_t capacity) {
+    size_t n = 0;
+    size_t pos = 0;
+    while (pos < count) {
+        uint8_t token = in[pos++];
+        if (token < 0x80) {
+            size_t run = token + 1;
+            if (pos + run > count || n + run > capacity) return 0;
+            memcpy(out + n, in + pos, run);
+            pos += run;
+            n += run;
+            continue;
+        }
+        if (pos + 2 > count) return 0;
+        size_t length = token - 0x80 + LZ_MIN_MATCH;
+        size_t offset = in[pos] | (in[pos + 1] << 8);
+        pos += 2;
+        if (offset == 0 || offset > n || n + length > capacity) return 0;
+        for (size_t i = 0; i < length; i++, n++) out[n] = out[n - offset];
+    }
+    return n;
+}
+
+void write_u32(FILE* file, uint32_t value) {
+    uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+bool read_u32(FILE* file, uint32_t* value) {
+    uint8_t bytes[4];
+    if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) return false;
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    return true;
+}
+
+// the block goes out whole, so a trace cut short by a crash still replays
+// up to its last block
+void trace_write_block(Trace* trace) {
+    if (trace->used == 0) return;
+    size_t packed = lz_compress(trace->block, trace->used, trace->packed);
+    write_u32(trace->file, trace->used);
+    if (packed < trace->used) {
+        write_u32(trace->file, packed);
+        fwrite(trace->packed, 1, packed, trace->file);
+    } else {
+        write_u32(trace->file, trace->used);
+        fwrite(trace->block, 1, trace->used, trace->file);
+    }
+    fflush(trace->file);
+    trace->used = 0;
+}
+
+bool trace_read_block(Trace* trace) {
+    uint32_t size, stored;
+    if (!read_u32(trace->file, &size) || !read_u32(trace->file, &stored)) return false;
+    if (size == 0 || size > TRACE_BLOCK_SIZE || stored > size) return false;
+    trace->used = 0;
+    trace->count = 0;
+    if (stored == size) {
+        if (fread(trace->block, 1, size, trace->file) != size) return false;
+    } else {
+        if (fread(trace->packed, 1, stored, trace->file) != stored) return false;
+        if (lz_decompress(trace->packed, stored, trace->block, TRACE_BLOCK_SIZE) != size) return false;
+    }
+    trace->count = size;
+    return true;
+}
+
+void trace_write_record(Trace* trace, Trace_Tag tag, uint64_t payload) {
+    if (trace->used + TRACE_RECORD_MAX > TRACE_BLOCK_SIZE) trace_write_block(trace);
+    uint64_t value = (payload << 2) | tag;
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        trace->block[trace->used++] = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+}
+
+// reads the next record, or only looks at it when `consume` is false.
+// false at the end of the trace
+bool trace_read_record(Trace* trace, Trace_Tag* tag, uint64_t* payload, bool consume) {
+    if (trace->used == trace->count && !trace_read_block(trace)) return false;
+    uint64_t value = 0;
+    size_t at = trace->used;
+    for (int shift = 0; at < trace->count; shift += 7) {
+        uint8_t byte = trace->block[at++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) != 0) continue;
+        *tag = value & 0b11;
+        *payload = value >> 2;
+        if (consume) trace->used = at;
+        return true;
+    }
+    return false;
+}
+
+void record_steps(Trace* trace) {
+    if (trace->steps == 0) return;
+    trace_write_record(trace, TRACE_STEPS, trace->steps);
+    trace->steps = 0;
+}
+
+void record_retire(Trace* trace, uWord pc) {
+    if (pc == trace->next_pc) {
+        trace->steps++;
+    } else {
+        record_steps(trace);
+        Word delta = (Word)(uWord)(pc - trace->next_pc);
+        trace_write_record(trace, TRACE_JUMP, (uWord)((delta << 1) ^ (delta >> 15)));
+    }
+    trace->next_pc = pc + 1;
+    trace->retired++;
+}
+
+void record_input(Trace* trace, uWord value) {
+    record_steps(trace);
+    trace_write_record(trace, TRACE_INPUT, value);
+}
+
+void record_interrupt(Trace* trace, Interrupt_Source source) {
+    record_steps(trace);
+    trace_write_record(trace, TRACE_INTERRUPT, source);
+}
+
+void replay_diverged(Trace* trace, const char* what) {
+    if (!trace->failed) printf("[ERROR] replay diverged from the trace after %llu instructions: %s\n", (unsigned long long)trace->retired, what);
+    trace->failed = true;
+}
+
+// false when the instruction at `pc` is not the one the recording ran next,
+// or the trace is over
+bool replay_retire(Trace* trace, uWord pc) {
+    if (trace->failed) return false;
+    if (trace->steps == 0) {
+        Trace_Tag tag;
+        uint64_t payload;
+        if (!trace_read_record(trace, &tag, &payload, true)) return false;
+        if (tag == TRACE_JUMP) {
+            uWord zigzag = payload;
+            trace->next_pc += (uWord)((zigzag >> 1) ^ -(zigzag & 1));
+            trace->steps = 1;
+        } else if (tag == TRACE_STEPS) {
+            trace->steps = payload;
+        } else {
+            replay_diverged(trace, "the recording read an input here");
+            return false;
+        }
+    }
+    if (pc != trace->next_pc) {
+        replay_diverged(trace, "the recording ran another instruction here");
+        return false;
+    }
+    trace->steps--;
+    trace->next_pc++;
+    trace->retired++;
+    return true;
+}
+
+uWord replay_input(Trace* trace) {
+    Trace_Tag tag;
+    uint64_t payload;
+    if (trace->failed) return 0;
+    if (trace->steps != 0 || !trace_read_record(trace, &tag, &payload, true) || tag != TRACE_INPUT) {
+        replay_diverged(trace, "the recording did not read an input here");
+        return 0;
+    }
+    return payload;
+}
+
+bool replay_at_end(Trace* trace) {
+    Trace_Tag tag;
+    uint64_t payload;
+    return trace->steps == 0 && !trace_read_record(trace, &tag, &payload, false);
+}
+
+bool is_replaying(const Machine* machine) {
+    return machine->trace != NULL && machine->trace->replay;
+}
+
+// the trace only fits the memory it was recorded on
+uint32_t memory_checksum(Memory memory) {
+    uint32_t hash = 2166136261u;
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        uWord word = read_memory(memory, addr);
+        hash = (hash ^ (word & 0xFF)) * 16777619u;
+        hash = (hash ^ (word >> 8)) * 16777619u;
+    }
+    return hash;
+}
+
+Trace* start_recording(const char* file_name, const Machine* machine, Memory memory) {
+    FILE* file = fopen(file_name, "wb");
+    if (file == NULL) {
+        printf("[ERROR] could not open `%s` to record a trace\n", file_name);
+        return NULL;
+    }
+    Trace* trace = calloc(1, sizeof(*trace));
+    trace->file = file;
+    trace->next_pc = machine->PC;
+    write_u32(file, TRACE_MAGIC);
+    write_u32(file, TRACE_VERSION);
+    write_u32(file, memory_checksum(memory));
+    write_u32(file, machine->hle ? TRACE_FLAG_HLE : 0);
+    return trace;
+}
+
+// the flags the trace was recorded with are put back on the machine
+Trace* start_replay(const char* file_name, Machine* machine, Memory memory) {
+    FILE* file = fopen(file_name, "rb");
+    if (file == NULL) {
+        printf("[ERROR] could not open trace `%s`\n", file_name);
+        return NULL;
+    }
+    uint32_t magic, version, checksum, flags;
+    if (!read_u32(file, &magic) || !read_u32(file, &version) || !read_u32(file, &checksum) || !read_u32(file, &flags) ||
+        magic != TRACE_MAGIC || version != TRACE_VERSION) {
+        printf("[ERROR] `%s` is not a trace\n", file_name);
+        fclose(file);
+        return NULL;
+    }
+    if (checksum != memory_checksum(memory)) {
+        printf("[ERROR] trace `%s` was recorded with another os or program\n", file_name);
+        fclose(file);
+        return NULL;
+    }
+    Trace* trace = calloc(1, sizeof(*trace));
+    trace->file = file;
+    trace->replay = true;
+    trace->next_pc = machine->PC;
+    machine->hle = (flags & TRACE_FLAG_HLE) != 0;
+    return trace;
+}
+
+void finish_trace(Trace* trace) {
+    if (!trace->replay) {
+        record_steps(trace);
+        trace_write_block(trace);
+    }
+    fclose(trace->file);
+    free(trace);
+}
+
+// device registers, see `attach_device`. both return false for addresses
+// no device answers to, those are plain memory
+bool io_read(Machine* machine, Memory memory, uWord addr, uWord* value);
+bool io_write(Machine* machine, uWord addr, uWord value);
+
+// a data load. only the I/O page costs a second look, everything under it is
+// the same page table read as `read_memory`
+uWord load_memory(Machine* machine, Memory memory, uWord addr) {
+    uWord value;
+    if (addr >= MEM_IOREG_BEGIN && io_read(machine, memory, addr, &value)) return value;
+    return read_memory(memory, addr);
+}
+
+#if _DEBUGGER
+void log_write(Timeline* timeline, uWord addr, uWord value);
+#endif
+
+// every store to guest memory goes through here so the predecoded copy of
+// that address is dropped, this is what keeps self modifying code working
+void write_memory(Machine* machine, Memory memory, uWord addr, uWord value) {
+#if _DEBUGGER
+    if (machine->timeline != NULL) log_write(machine->timeline, addr, value);
+#endif
+    if (addr >= MEM_IOREG_BEGIN) {
+        machine->event = true; // the MCR lives up there
+        if (io_write(machine, addr, value)) return;
+    }
+    poke_memory(memory, addr, value);
+    machine->decoded[addr].kind = DEC_MISS;
+    if (machine->jit != NULL) jit_invalidate_write(machine->jit, addr);
+}
+
+// the vector in the interrupt vector table each source goes through and the
+// priority its handler runs at. a source is only taken while the priority
+// level in the PSR is below its own
+static const struct {
+    uint8_t vector;
+    uint8_t priority;
+} interrupt_sources[INT_COUNT] = {
+    [INT_TIMER]    = { .vector = 0x81, .priority = 6 },
+    [INT_KEYBOARD] = { .vector = 0x80, .priority = 4 },
+};
+
+// anything that raises an interrupt has to come through here, it is taken
+// the next time `run` looks at events
+void raise_interrupt(Machine* machine, Interrupt_Source source) {
+    machine->int_pending |= 1 << source;
+    machine->event = true;
+}
+
+// the state is pushed so that RTI pops it off again
+void handle_int(Machine* machine, Memory memory, Interrupt_Source source) {
+    if (machine->trace != NULL && !machine->trace->replay) record_interrupt(machine->trace, source);
+    sync_flags(machine);
+    write_memory(machine, memory, ++machine->SSP, machine->PC);
+    write_memory(machine, memory, ++machine->SSP, machine->PSR);
+    machine->PSR &= ~(PSR_BIT_SSM | PSR_PRIORITY_MASK);
+    machine->PSR |= interrupt_sources[source].priority << PSR_PRIORITY_SHIFT;
+    machine->PC = read_memory(memory, MEM_INTERVT_BEGIN + interrupt_sources[source].vector);
+    machine->int_pending &= ~(1 << source);
+}
+
+// takes the highest priority pending interrupt the PSR lets through, if any
+void take_interrupt(Machine* machine, Memory memory) {
+    int level = (machine->PSR & PSR_PRIORITY_MASK) >> PSR_PRIORITY_SHIFT;
+    int best = -1;
+    for (int source = 0; source < INT_COUNT; source++) {
+        if ((machine->int_pending & (1 << source)) == 0) continue;
+        if (interrupt_sources[source].priority <= level) continue;
+        if (best < 0 || interrupt_sources[source].priority > interrupt_sources[best].priority) best = source;
+    }
+    if (best >= 0) handle_int(machine, memory, best);
+}
+
+// a replay takes the interrupts where the trace has them instead, before
+// the instruction they came in front of
+void replay_interrupts(Machine* machine, Memory memory) {
+    Trace* trace = machine->trace;
+    Trace_Tag tag;
+    uint64_t source;
+    while (trace->steps == 0 && trace_read_record(trace, &tag, &source, false) && tag == TRACE_INTERRUPT) {
+        trace_read_record(trace, &tag, &source, true);
+        if (source < INT_COUNT) handle_int(machine, memory, source);
+    }
+}
+
+// fires `kind` after `delay` more instructions, EVENT_NEVER turns it off.
+// the deadline is only worked out once the engine has stopped, see `run`,
+// so the instruction count it starts from is exact
+void schedule_event(Machine* machine, Event_Kind kind, uint64_t delay) {
+    machine->delay[kind] = delay;
+    machine->rescheduled |= 1 << kind;
+    machine->event = true;
+}
+
+// what the guest can see of a cpu, the caches and the i/o hookup stay as they are
+void copy_cpu_state(Machine* to, const Machine* from) {
+    memcpy(to->registers, from->registers, sizeof(to->registers));
+    to->PC = from->PC;
+    to->IR = from->IR;
+    to->PSR = from->PSR;
+    to->SSP = from->SSP;
+    to->int_pending = from->int_pending;
+    to->rescheduled = from->rescheduled;
+    memcpy(to->deadline, from->deadline, sizeof(to->deadline));
+    memcpy(to->delay, from->delay, sizeof(to->delay));
+    to->next_event = from->next_event;
+    to->cc_result = from->cc_result;
+    to->icount = from->icount;
+    to->input_pos = from->input_pos;
+    to->event = true;
+    to->resuming = 0;
+}
+
+typedef struct {
+    Machine cpu; // only the state `copy_cpu_state` copies is kept
+    Memory memory;
+    uint8_t* devices; // the state of every attached device, see `save_devices`
+} Snapshot;
+
+uint8_t* save_devices(const Machine* machine);
+void load_devices(Machine* machine, const uint8_t* saved);
+
+// O(pages) pointer copies, the pages themselves are shared until someone writes
+Snapshot take_snapshot(const Machine* machine, Memory memory) {
+    Snapshot snapshot = {0};
+    copy_cpu_state(&snapshot.cpu, machine);
+    snapshot.memory = fork_memory(memory);
+    snapshot.devices = save_devices(machine);
+    return snapshot;
+}
+
+// only the pages that differ from the snapshot are swapped, and only those
+// lose their predecoded instructions and translated blocks
+void restore_snapshot(Machine* machine, Memory memory, const Snapshot* snapshot) {
+    copy_cpu_state(machine, &snapshot->cpu);
+    load_devices(machine, snapshot->devices);
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        Page* page = snapshot->memory->pages[i];
+        if (memory->pages[i] == page) continue;
+        retain_page(page);
+        release_page(memory->pages[i]);
+        map_page(memory, i, page, false);
+        for (int offset = 0; offset < PAGE_WORDS; offset++) {
+            machine->decoded[i * PAGE_WORDS + offset].kind = DEC_MISS;
+        }
+        if (machine->jit != NULL) jit_invalidate_write(machine->jit, i * PAGE_WORDS);
+    }
+}
+
+void free_snapshot(Snapshot* snapshot) {
+    free_memory(snapshot->memory);
+    free(snapshot->devices);
+    snapshot->memory = NULL;
+    snapshot->devices = NULL;
+}
+
 void op_add_reg(uWord rest, Machine *machine) {
     int DR_id  = (rest & 0b0000111000000000) >> 9;
     int SR1_id = (rest & 0b0000000111000000) >> 6;
@@ -245,9 +1088,10 @@ void op_br(uWord rest, Machine* machine) {
     bool z = (rest & 0b0000010000000000) != 0;
     bool p = (rest & 0b0000001000000000) != 0;
     int offset = rest & 0b0000000111111111;  
-    bool cond = n && ((machine->PSR & 0b0000000000000100) != 0) 
-             || z && ((machine->PSR & 0b0000000000000010) != 0)
-             || p && ((machine->PSR & 0b0000000000000001) != 0);
+    uWord flags = read_flags(machine);
+    bool cond = n && ((flags & 0b0000000000000100) != 0) 
+             || z && ((flags & 0b0000000000000010) != 0)
+             || p && ((flags & 0b0000000000000001) != 0);
     if (cond) machine->PC += sext(offset, 9);
 }
 
@@ -277,8 +1121,8 @@ void op_ld(uWord rest, Machine* machine, Memory memory) {
     uWord DR_id  = (rest & 0b0000111000000000) >> 9; 
     uWord offset = (rest & 0b0000000111111111); 
 
-    size_t addr = machine->PC + sext(offset, 9);
-    uint16_t result = memory[addr];
+    uWord addr = machine->PC + sext(offset, 9);
+    uint16_t result = load_memory(machine, memory, addr);
     machine->registers[DR_id] = result;
     set_flags_from_result(machine, result);
 }
@@ -287,9 +1131,9 @@ void op_ldi(uWord rest, Machine* machine, Memory memory) {
     uWord DR_id  = (rest & 0b0000111000000000) >> 9; 
     uWord offset = (rest & 0b0000000111111111); 
 
-    uWord addr = memory[machine->PC + sext(offset, 9)];
+    uWord addr = load_memory(machine, memory, (uWord)(machine->PC + sext(offset, 9)));
 
-    Word result = (Word)memory[addr];
+    Word result = (Word)load_memory(machine, memory, addr);
     machine->registers[DR_id] = result;
 
     set_flags_from_result(machine, result);
@@ -302,7 +1146,7 @@ void op_ldr(uWord rest, Machine* machine, Memory memory) {
 
     uWord abs_addr = machine->registers[BaseR_id] + offset;
 
-    Word result = memory[abs_addr];
+    Word result = load_memory(machine, memory, abs_addr);
     machine->registers[DR_id] = result;
 
     set_flags_from_result(machine, result);
@@ -322,16 +1166,16 @@ void op_st(uWord rest, Machine* machine, Memory memory) {
     uWord SR_id  = (rest & 0b0000111000000000) >> 9; 
     uWord offset = (rest & 0b0000000111111111); 
 
-    memory[machine->PC + sext(offset, 9)] = machine->registers[SR_id];
+    write_memory(machine, memory, machine->PC + sext(offset, 9), machine->registers[SR_id]);
 }
 
 void op_sti(uWord rest, Machine* machine, Memory memory) {
     uWord SR_id  = (rest & 0b0000111000000000) >> 9; 
     uWord offset = (rest & 0b0000000111111111); 
 
-    uWord addr = memory[machine->PC + sext(offset, 9)];
+    uWord addr = load_memory(machine, memory, (uWord)(machine->PC + sext(offset, 9)));
 
-    memory[addr] = machine->registers[SR_id];
+    write_memory(machine, memory, addr, machine->registers[SR_id]);
 }
 
 void op_str(uWord rest, Machine* machine, Memory memory) {
@@ -339,78 +1183,727 @@ void op_str(uWord rest, Machine* machine, Memory memory) {
     uWord BaseR_id = (rest & 0b0000000111000000) >> 6;
     uWord offset   = (rest & 0b0000000000111111); 
 
-    memory[machine->registers[BaseR_id] + sext(offset, 6)] = machine->registers[SR_id];
+    uWord addr = machine->registers[BaseR_id] + sext(offset, 6);
+    write_memory(machine, memory, addr, machine->registers[SR_id]);
 }
 
 void op_rti(uWord rest, Machine* machine, Memory memory) {
+    sync_flags(machine);
     if ((machine->PSR & PSR_BIT_SSM) != 0) {
-        memory[machine->SSP++] = machine->PSR;
-        memory[machine->SSP++] = machine->PC;
-        machine->PC = memory[VEC_PRIV_MODE_VIOLATION];
+        write_memory(machine, memory, machine->SSP++, machine->PSR);
+        write_memory(machine, memory, machine->SSP++, machine->PC);
+        machine->PC = read_memory(memory, VEC_PRIV_MODE_VIOLATION);
     }
-    machine->PSR = memory[machine->SSP--];
-    machine->PC = memory[machine->SSP--];
+    machine->PSR = read_memory(memory, machine->SSP--);
+    machine->PC = read_memory(memory, machine->SSP--);
+    if (machine->int_pending != 0) machine->event = true; // the priority level might have dropped
 }
 
 #define TRAP_GETC (0x20)
 #define TRAP_OUT  (0x21)
 #define TRAP_HALT (0x25)
 #define TRAP_IN   (0x23)
+#define TRAP_PUTS  (0x22)
+#define TRAP_PUTSP (0x24)
 
 #define MACHINE_CONTROL_REGISTER (0xFFFE)
 
-void op_trap(uWord rest, Machine* machine, Memory memory) {
-    uint8_t trap_8 = rest & 0b11111111;
-    switch (trap_8) {
-        case TRAP_HALT: {
-            memory[MACHINE_CONTROL_REGISTER] = 0;
-        } break;
-        case TRAP_OUT: {
-            putc((uint8_t)machine->registers[0], stdout);
-        } break;
-        case TRAP_GETC: {
-            machine->registers[0] = getchar();
-        } break;
-        default: {
-            memory[machine->SSP++] = machine->PSR;
-            memory[machine->SSP++] = machine->PC;
-            machine->PSR &= ~PSR_BIT_SSM;
+#define CONSOLE_FLUSH_AT 4096
 
-            uWord addr = memory[trap_8 + MEM_TRAPVT_BEGIN];
+Console init_console(FILE* file) {
+    Console console = {0};
+    console.buffer = init_byte_data_size(CONSOLE_FLUSH_AT);
+    console.file = file;
+#if defined(__unix__)
+    console.flush_on_newline = file != NULL && isatty(fileno(file));
+#endif
+    return console;
+}
 
-            machine->PC = addr;
-        } break;
-    }
+// single producer, single consumer byte queue between the cpu and the device
+// thread. the indices run freely and get masked on access, `tail` is only
+// stored by the producer and `head` only by the consumer
+#define RING_SIZE (1 << 14)
+
+typedef struct {
+    uint8_t bytes[RING_SIZE];
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+} Ring;
+
+// both return how many bytes they moved, which can be less than asked for
+size_t ring_write(Ring* ring, const uint8_t* bytes, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t room = RING_SIZE - (tail - head);
+    if (count > room) count = room;
+    for (size_t i = 0; i < count; i++) ring->bytes[(tail + i) & (RING_SIZE - 1)] = bytes[i];
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
 }
 
-bool execute_instruction(Machine* machine, Instruction inst, Memory memory) {
-    Op_Id op   = (inst & 0b1111000000000000) >> 12;
-    uWord rest = (inst & 0b0000111111111111);
+size_t ring_read(Ring* ring, uint8_t* bytes, size_t count) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (count > tail - head) count = tail - head;
+    for (size_t i = 0; i < count; i++) bytes[i] = ring->bytes[(head + i) & (RING_SIZE - 1)];
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
 
-    switch (op) {
-        case Op_BR: {
-            op_br(rest, machine);
-        } break;
+size_t ring_count(Ring* ring) {
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) - atomic_load_explicit(&ring->head, memory_order_acquire);
+}
 
-        case Op_ADD: {
-            bool flag = (rest & 0b0000000000100000) != 0;
-            if (flag) {
-                op_add_imm(rest, machine);
-            } else {
-                op_add_reg(rest, machine);
-            }
-        } break;
+// the keyboard and the display on their own thread: it reads stdin into `keys`
+// and writes `output` to the console file, so the cpu never blocks in stdio
+struct Host_Io {
+    Ring keys;
+    Ring output;
+    FILE* file;
+    thrd_t thread;
+    _Atomic bool input_closed;  // stdin is done, every key before the end is in `keys`
+    _Atomic bool stop;
+    _Atomic uint64_t written;   // output bytes the device thread has written and flushed
+    uint64_t queued;            // output bytes the cpu has put in `output`
+    uint64_t parked;            // polling loops the cpu waited out instead of spinning
+};
 
-        case Op_LD: {
-            op_ld(rest, machine, memory);
-        } break;
+#define HOST_IO_CHUNK 4096
 
-        case Op_ST: {
-            op_st(rest, machine, memory);
-        } break;
+void host_io_wait() {
+    thrd_sleep(&(struct timespec){.tv_nsec = 50000}, NULL);
+}
 
-        case Op_JSR: {
-            bool flag = (rest & 0b0000100000000000) != 0;
+int update_device(void* arg) {
+#if defined(HOST_IO_SUPPORTED)
+    Host_Io* host = arg;
+    uint8_t chunk[HOST_IO_CHUNK];
+    struct pollfd input = {.fd = fileno(stdin), .events = POLLIN};
+    bool input_open = true;
+    for (;;) {
+        // output first, the guest does not wait on us reading ahead
+        size_t written = 0;
+        size_t count;
+        while ((count = ring_read(&host->output, chunk, sizeof(chunk))) > 0) {
+            fwrite(chunk, 1, count, host->file);
+            written += count;
+        }
+        if (written > 0) {
+            fflush(host->file);
+            atomic_fetch_add_explicit(&host->written, written, memory_order_release);
+        }
+        if (atomic_load_explicit(&host->stop, memory_order_acquire) && ring_count(&host->output) == 0) break;
+
+        size_t room = RING_SIZE - ring_count(&host->keys);
+        if (!input_open || room == 0) {
+            host_io_wait();
+            continue;
+        }
+        if (poll(&input, 1, 1) <= 0) continue;
+        ssize_t got = read(input.fd, chunk, room < sizeof(chunk) ? room : sizeof(chunk));
+        if (got <= 0) {
+            input_open = false;
+            atomic_store_explicit(&host->input_closed, true, memory_order_release);
+            continue;
+        }
+        ring_write(&host->keys, chunk, got);
+    }
+#endif
+    (void)arg;
+    return 0;
+}
+
+bool start_host_io(Host_Io* host, FILE* file) {
+#if defined(HOST_IO_SUPPORTED)
+    memset(host, 0, sizeof(*host));
+    host->file = file;
+    return thrd_create(&host->thread, update_device, host) == thrd_success;
+#else
+    (void)host;
+    (void)file;
+    return false;
+#endif
+}
+
+// writes out whatever is still queued before the thread goes away
+void stop_host_io(Host_Io* host) {
+    atomic_store_explicit(&host->stop, true, memory_order_release);
+    thrd_join(host->thread, NULL);
+}
+
+// the next key, or EOF once stdin is done. false when nothing came in yet
+bool host_io_key(Host_Io* host, int* key) {
+    uint8_t c;
+    if (ring_read(&host->keys, &c, 1) == 1) {
+        *key = c;
+        return true;
+    }
+    if (!atomic_load_explicit(&host->input_closed, memory_order_acquire)) return false;
+    // keys pushed before the close are visible now
+    *key = ring_read(&host->keys, &c, 1) == 1 ? c : EOF;
+    return true;
+}
+
+int host_io_getc(Host_Io* host) {
+    int key;
+    while (!host_io_key(host, &key)) host_io_wait();
+    return key;
+}
+
+// whether a getchar would return right away. stdin is unbuffered without a
+// device thread, so nothing read ahead hides in the stdio buffer
+bool stdin_has_key() {
+#if defined(HOST_IO_SUPPORTED)
+    struct pollfd input = {.fd = fileno(stdin), .events = POLLIN};
+    return poll(&input, 1, 0) > 0;
+#else
+    return true;
+#endif
+}
+
+void host_io_put(Host_Io* host, const uint8_t* bytes, size_t count) {
+    host->queued += count;
+    for (;;) {
+        size_t moved = ring_write(&host->output, bytes, count);
+        bytes += moved;
+        count -= moved;
+        if (count == 0) return;
+        host_io_wait();
+    }
+}
+
+// called when the buffer fills up, on a newline when attached to a terminal,
+// before blocking on TRAP_GETC, on halt and before the emulator prints
+// anything of its own
+void console_flush(Console* console) {
+    if (console == NULL || console->buffer.count == 0) return;
+    if (console->host != NULL) {
+        host_io_put(console->host, console->buffer.bytes, console->buffer.count);
+    } else if (console->file != NULL) {
+        fwrite(console->buffer.bytes, 1, console->buffer.count, console->file);
+        fflush(console->file);
+    } else {
+        return;
+    }
+    console->buffer.count = 0;
+    console->flushes++;
+}
+
+// a flush that also waits for the device thread to write everything out,
+// for when the emulator prints to the same file right after
+void console_sync(Console* console) {
+    console_flush(console);
+    if (console == NULL || console->host == NULL) return;
+    while (atomic_load_explicit(&console->host->written, memory_order_acquire) < console->host->queued) host_io_wait();
+}
+
+void console_put(Console* console, uint8_t c) {
+    push_data(&console->buffer, c);
+    console->bytes++;
+    if (console->file == NULL && console->host == NULL) return;
+    if (console->buffer.count >= CONSOLE_FLUSH_AT || (c == '\n' && console->flush_on_newline)) {
+        console_flush(console);
+    }
+}
+
+// memory mapped devices. a device answers for a range of registers in the
+// I/O page through its callbacks, registers without a device (like the MCR)
+// stay plain memory
+typedef struct Device Device;
+struct Device {
+    char* name;
+    uWord begin;
+    uWord end;  // last register, inclusive
+    uWord (*read)(Machine* machine, Memory memory, Device* device, uWord addr); // memory is for looking at the code polling it
+    void  (*write)(Machine* machine, Device* device, uWord addr, uWord value);
+    void* state;
+    size_t size; // bytes behind `state`, for snapshots
+};
+
+#define IO_REGISTER_COUNT (MEM_IOREG_END - MEM_IOREG_BEGIN + 1)
+#define MAX_DEVICES 8
+
+struct Io_Map {
+    Device devices[MAX_DEVICES];
+    int device_count;
+    uint8_t slot[IO_REGISTER_COUNT]; // index into `devices` plus one, 0 for plain memory
+};
+
+bool attach_device(Machine* machine, Device device) {
+    if (machine->io == NULL) machine->io = calloc(1, sizeof(*machine->io));
+    Io_Map* io = machine->io;
+    if (io->device_count >= MAX_DEVICES || device.begin < MEM_IOREG_BEGIN || device.end < device.begin) {
+        printf("[ERROR] cannot attach device `%s`\n", device.name);
+        return false;
+    }
+    io->devices[io->device_count++] = device;
+    for (size_t addr = device.begin; addr <= device.end; addr++) {
+        io->slot[addr - MEM_IOREG_BEGIN] = io->device_count;
+    }
+    return true;
+}
+
+bool io_read(Machine* machine, Memory memory, uWord addr, uWord* value) {
+    if (machine->io == NULL) return false;
+    int slot = machine->io->slot[addr - MEM_IOREG_BEGIN];
+    if (slot == 0) return false;
+    Device* device = &machine->io->devices[slot - 1];
+    if (is_replaying(machine)) {
+        *value = replay_input(machine->trace);
+        return true;
+    }
+    *value = device->read(machine, memory, device, addr);
+    if (machine->trace != NULL) record_input(machine->trace, *value);
+    return true;
+}
+
+// every device's state back to back, NULL when there are no devices
+uint8_t* save_devices(const Machine* machine) {
+    if (machine->io == NULL) return NULL;
+    size_t size = 0;
+    for (int i = 0; i < machine->io->device_count; i++) size += machine->io->devices[i].size;
+    uint8_t* saved = malloc(size + 1);
+    size_t at = 0;
+    for (int i = 0; i < machine->io->device_count; i++) {
+        const Device* device = &machine->io->devices[i];
+        memcpy(saved + at, device->state, device->size);
+        at += device->size;
+    }
+    return saved;
+}
+
+// `saved` has to come from the same machine, or a fork of it
+void load_devices(Machine* machine, const uint8_t* saved) {
+    if (machine->io == NULL || saved == NULL) return;
+    size_t at = 0;
+    for (int i = 0; i < machine->io->device_count; i++) {
+        Device* device = &machine->io->devices[i];
+        memcpy(device->state, saved + at, device->size);
+        at += device->size;
+    }
+}
+
+Device* io_device(Machine* machine, uWord addr) {
+    if (machine->io == NULL) return NULL;
+    int slot = machine->io->slot[addr - MEM_IOREG_BEGIN];
+    return slot == 0 ? NULL : &machine->io->devices[slot - 1];
+}
+
+bool io_write(Machine* machine, uWord addr, uWord value) {
+    if (machine->io == NULL) return false;
+    int slot = machine->io->slot[addr - MEM_IOREG_BEGIN];
+    if (slot == 0) return false;
+    Device* device = &machine->io->devices[slot - 1];
+    device->write(machine, device, addr, value);
+    return true;
+}
+
+#define DEV_KBSR (0xFE00) // keyboard status, bit 15 set when a key is waiting
+#define DEV_KBDR (0xFE02) // keyboard data
+#define DEV_DSR  (0xFE04) // display status, bit 15 set when it takes a character
+#define DEV_DDR  (0xFE06) // display data
+
+#define DEV_TMSR (0xFE08) // timer status, bit 15 set when it went off since the last read
+#define DEV_TMIR (0xFE0A) // timer interval in instructions, 0 stops it
+
+#define DEVICE_READY     (1 << 15)
+#define DEVICE_INTERRUPT (1 << 14) // interrupt enable, in the status registers
+
+// how often the keyboard looks for keys while its interrupt is enabled
+#define KEYBOARD_POLL_INTERVAL 1024
+
+bool is_poll_loop(Memory memory, uWord load);
+bool waiting_on_keys_only(Machine* machine);
+bool stdin_has_key();
+
+typedef struct {
+    uWord status;
+    uWord data;
+} Keyboard;
+
+// latches the next key if none is waiting. keys come from the machine input
+// when it has one, from the device thread when there is one and stdin
+// otherwise, which blocks like waiting on a real keyboard would. past the end
+// of the input every key is EOF. it only ever blocks while nothing but a key
+// can happen, with a timer or an interrupt on the way the guest keeps polling
+void keyboard_poll(Machine* machine, Memory memory, Keyboard* keyboard) {
+    if ((keyboard->status & DEVICE_READY) != 0) return;
+    bool wait = (keyboard->status & DEVICE_INTERRUPT) == 0 && waiting_on_keys_only(machine);
+    int c;
+    if (machine->input == NULL && machine->host != NULL) {
+        if (!host_io_key(machine->host, &c)) {
+            // nothing typed yet. a loop that does nothing but poll would spin
+            // until something is, so the cpu waits for it right here
+            if (!wait || !is_poll_loop(memory, machine->PC - 1)) return;
+            machine->host->parked++;
+            c = host_io_getc(machine->host);
+        }
+    } else if (machine->input == NULL) {
+        console_flush(machine->console);
+        if (!wait && !stdin_has_key()) return;
+        c = getchar();
+    } else if (machine->input_pos < machine->input->count) {
+        c = machine->input->bytes[machine->input_pos++];
+    } else {
+        c = EOF;
+    }
+    keyboard->data = (uWord)c;
+    keyboard->status |= DEVICE_READY;
+}
+
+// the interrupt side of the keyboard, it never blocks: keys come from the
+// machine input or the device thread. stdin without a device thread would
+// block, so it never interrupts
+void keyboard_update(Machine* machine, Keyboard* keyboard) {
+    if ((keyboard->status & DEVICE_INTERRUPT) == 0) {
+        schedule_event(machine, EVENT_KEYBOARD, EVENT_NEVER);
+        return;
+    }
+    if ((keyboard->status & DEVICE_READY) == 0) {
+        int c = EOF;
+        if (machine->input != NULL) {
+            if (machine->input_pos < machine->input->count) c = machine->input->bytes[machine->input_pos++];
+        } else if (machine->host != NULL) {
+            // nothing else can get the cpu out of an idle spin, so it waits
+            // for the key. unless a timer will
+            bool wait = machine->idle && waiting_on_keys_only(machine);
+            if (!host_io_key(machine->host, &c) && wait) c = host_io_getc(machine->host);
+        }
+        if (c != EOF) {
+            keyboard->data = (uWord)c;
+            keyboard->status |= DEVICE_READY;
+        } else if (machine->host != NULL && !atomic_load_explicit(&machine->host->input_closed, memory_order_acquire)) {
+            schedule_event(machine, EVENT_KEYBOARD, KEYBOARD_POLL_INTERVAL);
+            return;
+        }
+    }
+    if ((keyboard->status & DEVICE_READY) != 0) raise_interrupt(machine, INT_KEYBOARD);
+}
+
+uWord keyboard_read(Machine* machine, Memory memory, Device* device, uWord addr) {
+    Keyboard* keyboard = device->state;
+    switch (addr) {
+        case DEV_KBSR: {
+            keyboard_poll(machine, memory, keyboard);
+            return keyboard->status;
+        }
+        case DEV_KBDR: {
+            uWord data = keyboard->data;
+            keyboard->status &= ~DEVICE_READY;
+            if ((keyboard->status & DEVICE_INTERRUPT) != 0) keyboard_update(machine, keyboard);
+            return data;
+        }
+    }
+    return 0;
+}
+
+void keyboard_write(Machine* machine, Device* device, uWord addr, uWord value) {
+    Keyboard* keyboard = device->state;
+    if (addr != DEV_KBSR) return;
+    keyboard->status = (keyboard->status & DEVICE_READY) | (value & ~DEVICE_READY);
+    keyboard_update(machine, keyboard);
+}
+
+typedef struct {
+    uWord data;
+} Display;
+
+uWord display_read(Machine* machine, Memory memory, Device* device, uWord addr) {
+    Display* display = device->state;
+    switch (addr) {
+        case DEV_DSR: {
+            // with a device thread the display is busy while its queue is full
+            Host_Io* host = machine->host;
+            if (host == NULL || ring_count(&host->output) < RING_SIZE) return DEVICE_READY;
+            if (!is_poll_loop(memory, machine->PC - 1)) return 0;
+            host->parked++;
+            while (ring_count(&host->output) == RING_SIZE) host_io_wait();
+            return DEVICE_READY;
+        }
+        case DEV_DDR: return display->data;
+    }
+    return 0;
+}
+
+#if _DEBUGGER
+bool is_live(const Timeline* timeline);
+#endif
+
+void put_char(Machine* machine, uint8_t c) {
+#if _DEBUGGER
+    if (machine->timeline != NULL && !is_live(machine->timeline)) return; // it went out the first time round
+#endif
+    if (machine->console != NULL) console_put(machine->console, c);
+    else putc(c, stdout);
+}
+
+// the display is the console, same as TRAP_OUT
+void display_write(Machine* machine, Device* device, uWord addr, uWord value) {
+    Display* display = device->state;
+    if (addr != DEV_DDR) return;
+    display->data = value;
+    put_char(machine, (uint8_t)value);
+}
+
+typedef struct {
+    uWord status;
+    uWord interval;
+} Timer;
+
+uWord timer_read(Machine* machine, Memory memory, Device* device, uWord addr) {
+    (void)machine;
+    (void)memory;
+    Timer* timer = device->state;
+    switch (addr) {
+        case DEV_TMSR: {
+            uWord status = timer->status;
+            timer->status &= ~DEVICE_READY;
+            return status;
+        }
+        case DEV_TMIR: return timer->interval;
+    }
+    return 0;
+}
+
+// writing the interval starts the timer over
+void timer_write(Machine* machine, Device* device, uWord addr, uWord value) {
+    Timer* timer = device->state;
+    switch (addr) {
+        case DEV_TMSR: {
+            timer->status = (timer->status & DEVICE_READY) | (value & DEVICE_INTERRUPT);
+        } break;
+        case DEV_TMIR: {
+            timer->interval = value;
+            schedule_event(machine, EVENT_TIMER, value != 0 ? value : EVENT_NEVER);
+        } break;
+    }
+}
+
+// true while nothing but a key can change what the guest does next: no
+// interrupt waiting, no timer running and none that could interrupt
+bool waiting_on_keys_only(Machine* machine) {
+    if (machine->int_pending != 0 || machine->deadline[EVENT_TIMER] != EVENT_NEVER) return false;
+    Device* device = io_device(machine, DEV_TMSR);
+    return device == NULL || (((Timer*)device->state)->status & DEVICE_INTERRUPT) == 0;
+}
+
+void timer_tick(Machine* machine, Timer* timer) {
+    if (timer->interval == 0) return;
+    timer->status |= DEVICE_READY;
+    if ((timer->status & DEVICE_INTERRUPT) != 0) raise_interrupt(machine, INT_TIMER);
+    schedule_event(machine, EVENT_TIMER, timer->interval);
+}
+
+void fire_event(Machine* machine, Event_Kind kind) {
+    switch (kind) {
+        case EVENT_TIMER: {
+            Device* device = io_device(machine, DEV_TMSR);
+            if (device != NULL) timer_tick(machine, device->state);
+        } break;
+        case EVENT_KEYBOARD: {
+            Device* device = io_device(machine, DEV_KBSR);
+            if (device != NULL) keyboard_update(machine, device->state);
+        } break;
+        case EVENT_COUNT: break;
+    }
+}
+
+// turns new delays into deadlines and fires whatever is due, called by `run`
+// whenever the engine is stopped so `icount` is exact
+void update_schedule(Machine* machine) {
+    bool due = true;
+    while (machine->rescheduled != 0 || due) {
+        for (int kind = 0; kind < EVENT_COUNT; kind++) {
+            if ((machine->rescheduled & (1 << kind)) == 0) continue;
+            uint64_t delay = machine->delay[kind];
+            machine->deadline[kind] = delay == EVENT_NEVER ? EVENT_NEVER : machine->icount + delay;
+        }
+        machine->rescheduled = 0;
+        due = false;
+        for (int kind = 0; kind < EVENT_COUNT; kind++) {
+            if (machine->deadline[kind] > machine->icount) continue;
+            machine->deadline[kind] = EVENT_NEVER;
+            fire_event(machine, kind);
+            due = true;
+        }
+    }
+    machine->idle = false;
+    machine->next_event = EVENT_NEVER;
+    for (int kind = 0; kind < EVENT_COUNT; kind++) {
+        if (machine->deadline[kind] < machine->next_event) machine->next_event = machine->deadline[kind];
+    }
+}
+
+void attach_standard_devices(Machine* machine) {
+    attach_device(machine, (Device){
+        .name = "keyboard", .begin = DEV_KBSR, .end = DEV_KBDR,
+        .read = keyboard_read, .write = keyboard_write, .state = calloc(1, sizeof(Keyboard)), .size = sizeof(Keyboard),
+    });
+    attach_device(machine, (Device){
+        .name = "display", .begin = DEV_DSR, .end = DEV_DDR,
+        .read = display_read, .write = display_write, .state = calloc(1, sizeof(Display)), .size = sizeof(Display),
+    });
+    attach_device(machine, (Device){
+        .name = "timer", .begin = DEV_TMSR, .end = DEV_TMIR,
+        .read = timer_read, .write = timer_write, .state = calloc(1, sizeof(Timer)), .size = sizeof(Timer),
+    });
+}
+
+// the TRAP every vector but the native ones goes through
+void enter_trap(Machine* machine, Memory memory, uint8_t trap_8) {
+    sync_flags(machine);
+    write_memory(machine, memory, machine->SSP++, machine->PSR);
+    write_memory(machine, memory, machine->SSP++, machine->PC);
+    machine->PSR &= ~PSR_BIT_SSM;
+
+    uWord addr = read_memory(memory, trap_8 + MEM_TRAPVT_BEGIN);
+
+    machine->PC = addr;
+}
+
+void op_trap(uWord rest, Machine* machine, Memory memory);
+
+bool is_breakpoint(const Machine* machine, uWord addr);
+extern Decoded decode_table[1 << 16];
+
+// the code of the trap routines in the stock os.s, the data words after them
+// are not part of it. PUTSP is the same routine as PUTS
+static const uWord stock_puts[] = {
+    0x6969, 0x300B, 0x320B, 0x2209, 0x5020, 0x6040, 0x0403, 0xF021, 0x1261, 0x0FFB, 0x2002, 0x2202, 0x8000,
+};
+static const uWord stock_in[] = {
+    0x31FD, 0xF020, 0xF021, 0x8000,
+};
+
+#define ARRAY_LEN(array) (sizeof(array) / sizeof((array)[0]))
+
+// whether `routine` is still the stock code. words the TRAP itself is about
+// to push over, or that carry a breakpoint, rule it out
+bool is_stock_routine(const Machine* machine, Memory memory, uWord routine, const uWord* code, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uWord addr = routine + i;
+        if (read_memory(memory, addr) != code[i] || is_breakpoint(machine, addr)) return false;
+        if (addr == machine->SSP || addr == (uWord)(machine->SSP + 1)) return false;
+    }
+    return true;
+}
+
+// services TRAP x22, x23 and x24 in one go while their vectors still point at
+// the stock os.s routines, instead of running the guest loop with a nested
+// TRAP x21 for every character. the machine ends up exactly as if the routine
+// had run, stack words and quirks included, only `icount` does not count the
+// instructions it would have taken. anything else is left to the guest
+bool hle_trap(Machine* machine, Memory memory, uint8_t trap_8) {
+    uWord vector = trap_8 + MEM_TRAPVT_BEGIN;
+    if (vector == machine->SSP || vector == (uWord)(machine->SSP + 1)) return false;
+    uWord routine = read_memory(memory, vector);
+    Word* R = machine->registers;
+    switch (trap_8) {
+        case TRAP_PUTS:
+        case TRAP_PUTSP: {
+            if (!is_stock_routine(machine, memory, routine, stock_puts, ARRAY_LEN(stock_puts))) return false;
+            uWord save_r0 = routine + 2 + decode_table[stock_puts[1]].imm;
+            uWord save_r1 = routine + 3 + decode_table[stock_puts[2]].imm;
+            // the string has to end before the i/o page and stay clear of
+            // everything the routine writes on the way
+            uWord end = R[0];
+            for (;;) {
+                if (end >= MEM_IOREG_BEGIN) return false;
+                if (end == save_r0 || end == save_r1 || end == machine->SSP || end == (uWord)(machine->SSP + 1)) return false;
+                if (read_memory(memory, end) == 0) break;
+                end++;
+            }
+
+            enter_trap(machine, memory, trap_8);
+            machine->PC = routine + ARRAY_LEN(stock_puts) - 1;
+            // `.fill #x6969` at the top runs as an LDR
+            Decoded ldr = decode_table[stock_puts[0]];
+            Word result = load_memory(machine, memory, (uWord)(R[ldr.r1] + ldr.imm));
+            R[ldr.r0] = result;
+            set_flags_from_result(machine, result);
+            write_memory(machine, memory, save_r0, R[0]);
+            write_memory(machine, memory, save_r1, R[1]);
+            for (uWord addr = R[0]; addr != end; addr++) put_char(machine, (uint8_t)read_memory(memory, addr));
+        } break;
+        case TRAP_IN: {
+            if (!is_stock_routine(machine, memory, routine, stock_in, ARRAY_LEN(stock_in))) return false;
+            uWord save_r0 = routine + 1 + decode_table[stock_in[0]].imm;
+
+            enter_trap(machine, memory, trap_8);
+            machine->PC = routine + ARRAY_LEN(stock_in) - 1;
+            write_memory(machine, memory, save_r0, R[0]);
+            op_trap(TRAP_GETC, machine, memory);
+            op_trap(TRAP_OUT, machine, memory);
+        } break;
+        default: return false;
+    }
+    // PC is on the RTI at the end of the routine
+    machine->PC++;
+    op_rti(0, machine, memory);
+    return true;
+}
+
+void op_trap(uWord rest, Machine* machine, Memory memory) {
+    uint8_t trap_8 = rest & 0b11111111;
+    switch (trap_8) {
+        case TRAP_HALT: {
+            write_memory(machine, memory, MACHINE_CONTROL_REGISTER, 0);
+            console_flush(machine->console);
+        } break;
+        case TRAP_OUT: {
+            put_char(machine, (uint8_t)machine->registers[0]);
+        } break;
+        case TRAP_GETC: {
+            if (is_replaying(machine)) {
+                machine->registers[0] = replay_input(machine->trace);
+            } else if (machine->input == NULL) {
+                console_flush(machine->console); // the prompt has to be out before we block
+                machine->registers[0] = machine->host != NULL ? host_io_getc(machine->host) : getchar();
+            } else if (machine->input_pos < machine->input->count) {
+                machine->registers[0] = machine->input->bytes[machine->input_pos++];
+            } else {
+                machine->registers[0] = EOF;
+            }
+            if (machine->trace != NULL && !machine->trace->replay) record_input(machine->trace, machine->registers[0]);
+        } break;
+        default: {
+            if (machine->hle && hle_trap(machine, memory, trap_8)) break;
+            enter_trap(machine, memory, trap_8);
+        } break;
+    }
+}
+
+// the original decoder, pulls every field out of the word again on each call.
+// kept as the reference `execute_instruction` is checked and benchmarked against
+bool execute_instruction_masked(Machine* machine, Instruction inst, Memory memory) {
+    Op_Id op   = (inst & 0b1111000000000000) >> 12;
+    uWord rest = (inst & 0b0000111111111111);
+
+    switch (op) {
+        case Op_BR: {
+            op_br(rest, machine);
+        } break;
+
+        case Op_ADD: {
+            bool flag = (rest & 0b0000000000100000) != 0;
+            if (flag) {
+                op_add_imm(rest, machine);
+            } else {
+                op_add_reg(rest, machine);
+            }
+        } break;
+
+        case Op_LD: {
+            op_ld(rest, machine, memory);
+        } break;
+
+        case Op_ST: {
+            op_st(rest, machine, memory);
+        } break;
+
+        case Op_JSR: {
+            bool flag = (rest & 0b0000100000000000) != 0;
             if (flag) {
                op_jsr(rest, machine);
             } else {
@@ -443,60 +1936,2480 @@ bool execute_instruction(Machine* machine, Instruction inst, Memory memory) {
             op_not(rest, machine);
         } break;
 
-        case Op_LDI: {
-            op_ldi(rest, machine, memory);
-        } break;
+        case Op_LDI: {
+            op_ldi(rest, machine, memory);
+        } break;
+
+        case Op_STI: {
+            op_sti(rest, machine, memory);
+        } break;
+
+        case Op_JMP: {
+            op_jmp(rest, machine);
+        } break;
+
+        case Op_RES: {
+            printf("[ERROR] Illegal Opcode\n");
+            return false;
+        } break;
+
+        case Op_LEA: {
+            op_lea(rest, machine);
+        } break;
+
+        case Op_TRAP: {
+            op_trap(rest, machine, memory);
+        } break;
+    }
+    return true;
+}
+
+Decoded decode_instruction(Instruction inst) {
+    Op_Id op   = (inst & 0b1111000000000000) >> 12;
+    uWord rest = (inst & 0b0000111111111111);
+
+    Decoded d = {0};
+    d.r0 = (rest & 0b0000111000000000) >> 9;
+    d.r1 = (rest & 0b0000000111000000) >> 6;
+    d.r2 = (rest & 0b0000000000000111) >> 0;
+
+    bool imm_flag = (rest & 0b0000000000100000) != 0;
+    switch (op) {
+        case Op_BR: {
+            d.r2   = d.r0; // n z p -> PSR bits 2 1 0, same order as `flags_from_result`
+            d.imm  = sext(rest & 0b0000000111111111, 9);
+            d.kind = d.imm == -1 ? DEC_SPIN : DEC_BR;
+        } break;
+        case Op_ADD: {
+            d.kind = imm_flag ? DEC_ADD_IMM : DEC_ADD_REG;
+            d.imm  = sext(rest & 0b0000000000011111, 5);
+        } break;
+        case Op_AND: {
+            d.kind = imm_flag ? DEC_AND_IMM : DEC_AND_REG;
+            d.imm  = sext(rest & 0b0000000000011111, 5);
+        } break;
+        case Op_NOT: {
+            d.kind = DEC_NOT;
+        } break;
+        case Op_JSR: {
+            if ((rest & 0b0000100000000000) != 0) {
+                d.kind = DEC_JSR;
+                d.imm  = sext(rest & 0b0000011111111111, 11);
+            } else {
+                d.kind = DEC_JSRR;
+            }
+        } break;
+        case Op_JMP: {
+            d.kind = DEC_JMP;
+        } break;
+        case Op_LD: {
+            d.kind = DEC_LD;
+            d.imm  = sext(rest & 0b0000000111111111, 9);
+        } break;
+        case Op_LDI: {
+            d.kind = DEC_LDI;
+            d.imm  = sext(rest & 0b0000000111111111, 9);
+        } break;
+        case Op_LEA: {
+            d.kind = DEC_LEA;
+            d.imm  = sext(rest & 0b0000000111111111, 9);
+        } break;
+        case Op_ST: {
+            d.kind = DEC_ST;
+            d.imm  = sext(rest & 0b0000000111111111, 9);
+        } break;
+        case Op_STI: {
+            d.kind = DEC_STI;
+            d.imm  = sext(rest & 0b0000000111111111, 9);
+        } break;
+        case Op_LDR: {
+            // `op_ldr` does not sign extend its offset, keep it that way
+            d.kind = DEC_LDR;
+            d.imm  = rest & 0b0000000000111111;
+        } break;
+        case Op_STR: {
+            d.kind = DEC_STR;
+            d.imm  = sext(rest & 0b0000000000111111, 6);
+        } break;
+        case Op_RTI: {
+            d.kind = DEC_RTI;
+            d.imm  = rest;
+        } break;
+        case Op_TRAP: {
+            d.kind = DEC_TRAP;
+            d.imm  = rest;
+        } break;
+        case Op_RES: {
+            d.kind = DEC_RES;
+        } break;
+    }
+    return d;
+}
+
+// there are only 65536 instruction words, so all of them are decoded once up
+// front by `init_decode_table` and decoding is a single lookup after that
+Decoded decode_table[1 << 16];
+
+void init_decode_table() {
+    // word 0 is a BR, so a filled table never has DEC_MISS there
+    if (decode_table[0].kind != DEC_MISS) return;
+    for (uint32_t inst = 0; inst < (1 << 16); inst++) {
+        decode_table[inst] = decode_instruction(inst);
+    }
+}
+
+#define POLL_LOOP_MAX 8
+
+#define REG_BIT(r) (1u << (r))
+
+// whether `load`, which just read a device status register, sits in a loop
+// that can only ever leave once that status changes: straight line code from
+// a backward branch target to a branch on the flags of that very load, no
+// stores, no other loads, since memory an interrupt handler writes is as good
+// as a device, and no register that is carried from one trip around to the
+// next, so every trip computes the same thing until the device does something
+bool is_poll_loop(Memory memory, uWord load) {
+    uWord branch = load + 1;
+    Decoded d = decode_table[read_memory(memory, branch)];
+    if (d.kind != DEC_BR && d.kind != DEC_SPIN) return false;
+    uWord target = branch + 1 + d.imm;
+    if ((uWord)(load - target) >= POLL_LOOP_MAX) return false;
+
+    // registers written anywhere in the loop, a source that is one of them has
+    // to have been written earlier in the same trip
+    unsigned written = 0;
+    for (uWord pc = target; pc < branch; pc++) {
+        written |= REG_BIT(decode_table[read_memory(memory, pc)].r0);
+    }
+    unsigned defined = 0;
+    for (uWord pc = target; pc < branch; pc++) {
+        d = decode_table[read_memory(memory, pc)];
+        unsigned sources = 0;
+        switch (d.kind) {
+            case DEC_LD:
+            case DEC_LDI:     if (pc != load) return false; break;
+            case DEC_LDR:     if (pc != load) return false; sources = REG_BIT(d.r1); break;
+            case DEC_LEA:     break;
+            case DEC_ADD_IMM:
+            case DEC_AND_IMM:
+            case DEC_NOT:     sources = REG_BIT(d.r1); break;
+            case DEC_ADD_REG:
+            case DEC_AND_REG: sources = REG_BIT(d.r1) | REG_BIT(d.r2); break;
+            default:          return false;
+        }
+        if ((sources & written & ~defined) != 0) return false;
+        defined |= REG_BIT(d.r0);
+    }
+    return true;
+}
+
+bool execute_instruction(Machine* machine, Instruction inst, Memory memory) {
+    const Decoded* d = &decode_table[inst];
+    Word* R = machine->registers;
+    switch (d->kind) {
+        case DEC_BR:
+        case DEC_SPIN: {
+            if ((read_flags(machine) & d->r2) != 0) machine->PC += d->imm;
+        } break;
+        case DEC_ADD_REG: {
+            Word result = R[d->r1] + R[d->r2];
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+        } break;
+        case DEC_ADD_IMM: {
+            Word result = R[d->r1] + d->imm;
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+        } break;
+        case DEC_AND_REG: {
+            Word result = R[d->r1] & R[d->r2];
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+        } break;
+        case DEC_AND_IMM: {
+            Word result = R[d->r1] & d->imm;
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+        } break;
+        case DEC_NOT: {
+            Word result = ~R[d->r1];
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+        } break;
+        case DEC_JMP: {
+            machine->PC = R[d->r1];
+        } break;
+        case DEC_JSR: {
+            R[7] = machine->PC;
+            machine->PC += d->imm;
+        } break;
+        case DEC_JSRR: {
+            R[7] = machine->PC;
+            machine->PC = R[d->r1];
+        } break;
+        case DEC_LD: {
+            Word result = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+        } break;
+        case DEC_LDI: {
+            uWord addr = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+            Word result = load_memory(machine, memory, addr);
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+        } break;
+        case DEC_LDR: {
+            Word result = load_memory(machine, memory, (uWord)(R[d->r1] + d->imm));
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+        } break;
+        case DEC_LEA: {
+            Word result = machine->PC + d->imm;
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+        } break;
+        case DEC_ST: {
+            write_memory(machine, memory, machine->PC + d->imm, R[d->r0]);
+        } break;
+        case DEC_STI: {
+            uWord addr = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+            write_memory(machine, memory, addr, R[d->r0]);
+        } break;
+        case DEC_STR: {
+            write_memory(machine, memory, R[d->r1] + d->imm, R[d->r0]);
+        } break;
+        case DEC_RTI: {
+            op_rti(d->imm, machine, memory);
+        } break;
+        case DEC_TRAP: {
+            op_trap(d->imm, machine, memory);
+        } break;
+        case DEC_RES: {
+            printf("[ERROR] Illegal Opcode\n");
+            return false;
+        } break;
+        default: {
+            assert(false && "unreachable");
+        } break;
+    }
+    return true;
+}
+
+#define BREAKPOINT_WORD_BITS 64
+
+bool is_breakpoint(const Machine* machine, uWord addr) {
+    if (machine->breakpoints == NULL) return false;
+    return (machine->breakpoints[addr / BREAKPOINT_WORD_BITS] >> (addr % BREAKPOINT_WORD_BITS)) & 1;
+}
+
+// breakpoints cost nothing while they are not hit: the decoded entry for the
+// address is swapped for a DEC_BREAKPOINT, and the jit ends blocks in front of them
+void set_breakpoint(Machine* machine, uWord addr, bool enabled) {
+    if (machine->breakpoints == NULL) {
+        machine->breakpoints = calloc(MEMORY_SIZE / BREAKPOINT_WORD_BITS, sizeof(uint64_t));
+    }
+    uint64_t bit = (uint64_t)1 << (addr % BREAKPOINT_WORD_BITS);
+    if (enabled) machine->breakpoints[addr / BREAKPOINT_WORD_BITS] |= bit;
+    else         machine->breakpoints[addr / BREAKPOINT_WORD_BITS] &= ~bit;
+    machine->decoded[addr].kind = DEC_MISS;
+    if (machine->jit != NULL) jit_invalidate_write(machine->jit, addr);
+}
+
+Decoded decode_at(const Machine* machine, Memory memory, uWord addr) {
+    if (addr + 1 >= MEM_END) return (Decoded){ .kind = DEC_END_OF_MEMORY };
+    if (is_breakpoint(machine, addr)) return (Decoded){ .kind = DEC_BREAKPOINT };
+    return decode_table[read_memory(memory, addr)];
+}
+
+Decoded* fetch_decoded(Machine* machine, Memory memory) {
+    Decoded* d = &machine->decoded[machine->PC];
+    if (d->kind == DEC_MISS) *d = decode_at(machine, memory, machine->PC);
+    return d;
+}
+
+// the checks the old run loop made before every single instruction. `run`
+// only makes them on entry and after an instruction set `machine->event`,
+// returns false when the machine has to stop
+bool handle_events(Machine* machine, Memory memory, Stop_Reason* reason) {
+    machine->event = false;
+    if (read_memory(memory, MACHINE_CONTROL_REGISTER) == 0) {
+        *reason = STOP_HALTED;
+        return false;
+    }
+    if (machine->int_pending != 0 && machine->PC + 1 < MEM_END && !is_replaying(machine)) {
+        take_interrupt(machine, memory);
+    }
+    if (machine->rescheduled != 0) {
+        // back to `run`, which works out the new deadlines
+        *reason = STOP_BUDGET;
+        return false;
+    }
+    return true;
+}
+
+#if _DEBUGGER
+// -debug keeps the run's past around so it can be stepped backwards: a
+// snapshot every `interval` instructions and a log of every store in
+// between. going back restores the last snapshot before the target and runs
+// forward to it again, which the guest cannot tell from the first time since
+// its input comes from a file in -debug. time is `icount`
+typedef struct {
+    uint64_t icount; // of the instruction that stored
+    uWord pc;
+    uWord addr;
+    uWord value;
+} Write_Record;
+
+struct Timeline {
+    uint64_t interval;
+    uint64_t horizon;   // the furthest `icount` reached, everything before it already ran once
+    uint64_t now;       // `icount` of the instruction running
+    uWord pc;           // and its address
+    bool live;          // it runs for the first time: its output goes out and its stores are logged
+    Snapshot* snapshots; // in `icount` order, one per multiple of `interval`
+    size_t snapshot_count;
+    size_t snapshot_capacity;
+    Write_Record* writes; // in `icount` order, only first time round
+    size_t write_count;
+    size_t write_capacity;
+};
+
+#define DEBUG_SNAPSHOT_INTERVAL 100000
+
+Timeline* init_timeline(uint64_t interval) {
+    Timeline* timeline = calloc(1, sizeof(*timeline));
+    timeline->interval = interval == 0 ? DEBUG_SNAPSHOT_INTERVAL : interval;
+    timeline->live = true;
+    return timeline;
+}
+
+void free_timeline(Timeline* timeline) {
+    for (size_t i = 0; i < timeline->snapshot_count; i++) free_snapshot(&timeline->snapshots[i]);
+    free(timeline->snapshots);
+    free(timeline->writes);
+    free(timeline);
+}
+
+bool is_live(const Timeline* timeline) {
+    return timeline->live;
+}
+
+void timeline_step(Timeline* timeline, uint64_t now, uWord pc) {
+    timeline->now = now;
+    timeline->pc = pc;
+    timeline->live = now >= timeline->horizon;
+}
+
+void log_write(Timeline* timeline, uWord addr, uWord value) {
+    if (!timeline->live) return;
+    if (timeline->write_count >= timeline->write_capacity) {
+        timeline->write_capacity = (timeline->write_capacity + 1) * 2;
+        timeline->writes = realloc(timeline->writes, timeline->write_capacity * sizeof(*timeline->writes));
+    }
+    timeline->writes[timeline->write_count++] = (Write_Record){
+        .icount = timeline->now, .pc = timeline->pc, .addr = addr, .value = value,
+    };
+}
+
+// watchpoints and breakpoint conditions for -debug. a watchpoint is a bit per
+// address and kind of access, and every page has the kinds watched anywhere
+// in it, so the check in front of a load or store mostly ends at the page.
+// only the instrumented decode loop looks at them, see `hits_watchpoint`
+#define WATCH_READ  1
+#define WATCH_WRITE 2
+
+typedef enum {
+    COND_EQ,
+    COND_NE,
+    COND_LT,
+    COND_LE,
+    COND_GT,
+    COND_GE,
+    COND_COUNT,
+} Condition_Op;
+
+static char* condition_op_name[] = {
+    [COND_EQ] = "==",
+    [COND_NE] = "!=",
+    [COND_LT] = "<",
+    [COND_LE] = "<=",
+    [COND_GT] = ">",
+    [COND_GE] = ">=",
+};
+
+// a breakpoint with conditions only stops when one of them holds
+typedef struct {
+    uWord addr;
+    uint8_t reg; // R0-R7
+    uint8_t op;  // Condition_Op
+    Word value;  // compared signed
+} Condition;
+
+struct Debugger {
+    uint8_t watch_pages[PAGE_COUNT]; // WATCH_READ | WATCH_WRITE of the watchpoints in the page
+    uint64_t watch_read[MEMORY_SIZE / BREAKPOINT_WORD_BITS];
+    uint64_t watch_write[MEMORY_SIZE / BREAKPOINT_WORD_BITS];
+    Condition* conditions;
+    size_t condition_count;
+    size_t condition_capacity;
+    uWord hit_addr;   // the access the last STOP_WATCHPOINT was for
+    uint8_t hit_kind;
+};
+
+bool is_watched(const Debugger* debugger, uWord addr, uint8_t kind) {
+    if ((debugger->watch_pages[addr >> PAGE_BITS] & kind) == 0) return false;
+    const uint64_t* bits = kind == WATCH_READ ? debugger->watch_read : debugger->watch_write;
+    return (bits[addr / BREAKPOINT_WORD_BITS] >> (addr % BREAKPOINT_WORD_BITS)) & 1;
+}
+
+void set_watchpoint(Debugger* debugger, uWord addr, uint8_t kind, bool enabled) {
+    uint64_t bit = (uint64_t)1 << (addr % BREAKPOINT_WORD_BITS);
+    if (kind & WATCH_READ) {
+        if (enabled) debugger->watch_read[addr / BREAKPOINT_WORD_BITS] |= bit;
+        else         debugger->watch_read[addr / BREAKPOINT_WORD_BITS] &= ~bit;
+    }
+    if (kind & WATCH_WRITE) {
+        if (enabled) debugger->watch_write[addr / BREAKPOINT_WORD_BITS] |= bit;
+        else         debugger->watch_write[addr / BREAKPOINT_WORD_BITS] &= ~bit;
+    }
+    size_t page = addr >> PAGE_BITS;
+    size_t first = page * PAGE_WORDS / BREAKPOINT_WORD_BITS;
+    debugger->watch_pages[page] = 0;
+    for (size_t i = first; i < first + PAGE_WORDS / BREAKPOINT_WORD_BITS; i++) {
+        if (debugger->watch_read[i] != 0) debugger->watch_pages[page] |= WATCH_READ;
+        if (debugger->watch_write[i] != 0) debugger->watch_pages[page] |= WATCH_WRITE;
+    }
+}
+
+// the address the load or store in `d` at PC is going to touch. LDI and STI
+// read their pointer first, so that is a read too
+bool hits_watchpoint(Machine* machine, Memory memory, const Decoded* d) {
+    Debugger* debugger = machine->debugger;
+    uWord next = machine->PC + 1;
+    uWord addr;
+    uint8_t kind;
+    switch (d->kind) {
+        case DEC_LD:  addr = next + d->imm; kind = WATCH_READ; break;
+        case DEC_ST:  addr = next + d->imm; kind = WATCH_WRITE; break;
+        case DEC_LDR: addr = machine->registers[d->r1] + d->imm; kind = WATCH_READ; break;
+        case DEC_STR: addr = machine->registers[d->r1] + d->imm; kind = WATCH_WRITE; break;
+        case DEC_LDI:
+        case DEC_STI: {
+            uWord pointer = next + d->imm;
+            if (is_watched(debugger, pointer, WATCH_READ)) {
+                addr = pointer;
+                kind = WATCH_READ;
+                break;
+            }
+            // a device register would see the read, those pointers are not followed
+            if (pointer >= MEM_IOREG_BEGIN) return false;
+            addr = read_memory(memory, pointer);
+            kind = d->kind == DEC_LDI ? WATCH_READ : WATCH_WRITE;
+        } break;
+        default: return false;
+    }
+    if (!is_watched(debugger, addr, kind)) return false;
+    debugger->hit_addr = addr;
+    debugger->hit_kind = kind;
+    return true;
+}
+
+// a breakpoint without conditions stops every time
+void clear_conditions(Debugger* debugger, uWord addr) {
+    size_t kept = 0;
+    for (size_t i = 0; i < debugger->condition_count; i++) {
+        if (debugger->conditions[i].addr != addr) debugger->conditions[kept++] = debugger->conditions[i];
+    }
+    debugger->condition_count = kept;
+}
+
+void add_condition(Debugger* debugger, const Condition* condition) {
+    if (debugger->condition_count >= debugger->condition_capacity) {
+        debugger->condition_capacity = (debugger->condition_capacity + 1) * 2;
+        debugger->conditions = realloc(debugger->conditions, debugger->condition_capacity * sizeof(*debugger->conditions));
+    }
+    debugger->conditions[debugger->condition_count++] = *condition;
+}
+
+bool condition_holds(const Machine* machine, const Condition* condition) {
+    Word value = machine->registers[condition->reg];
+    switch (condition->op) {
+        case COND_EQ: return value == condition->value;
+        case COND_NE: return value != condition->value;
+        case COND_LT: return value < condition->value;
+        case COND_LE: return value <= condition->value;
+        case COND_GT: return value > condition->value;
+        case COND_GE: return value >= condition->value;
+    }
+    return true;
+}
+
+void free_debugger(Debugger* debugger) {
+    free(debugger->conditions);
+    free(debugger);
+}
+#endif // _DEBUGGER
+
+// whether the breakpoint at PC stops the machine, it has no conditions or one of them holds
+bool breakpoint_stops(const Machine* machine) {
+#if _DEBUGGER
+    const Debugger* debugger = machine->debugger;
+    if (debugger == NULL) return true;
+    bool conditional = false;
+    for (size_t i = 0; i < debugger->condition_count; i++) {
+        const Condition* condition = &debugger->conditions[i];
+        if (condition->addr != machine->PC) continue;
+        if (condition_holds(machine, condition)) return true;
+        conditional = true;
+    }
+    return !conditional;
+#else
+    (void)machine;
+    return true;
+#endif
+}
+
+// counters for -profile. only the instrumented build of the decode loop
+// touches them, see `run_instrumented`
+struct Profile {
+    uint64_t executed[MEMORY_SIZE];  // retired instructions per address
+    uint64_t taken[MEMORY_SIZE];     // per BR site
+    uint64_t not_taken[MEMORY_SIZE];
+    uint64_t ops[Op_TRAP + 1];       // retired instructions per Op_Id
+};
+
+// the Op_Id each decoded kind comes from
+static const uint8_t dec_op[DEC_COUNT] = {
+    [DEC_BR] = Op_BR,
+    [DEC_SPIN] = Op_BR,
+    [DEC_ADD_REG] = Op_ADD,
+    [DEC_ADD_IMM] = Op_ADD,
+    [DEC_LD] = Op_LD,
+    [DEC_ST] = Op_ST,
+    [DEC_JSR] = Op_JSR,
+    [DEC_JSRR] = Op_JSR,
+    [DEC_AND_REG] = Op_AND,
+    [DEC_AND_IMM] = Op_AND,
+    [DEC_LDR] = Op_LDR,
+    [DEC_STR] = Op_STR,
+    [DEC_RTI] = Op_RTI,
+    [DEC_NOT] = Op_NOT,
+    [DEC_LDI] = Op_LDI,
+    [DEC_STI] = Op_STI,
+    [DEC_JMP] = Op_JMP,
+    [DEC_RES] = Op_RES,
+    [DEC_LEA] = Op_LEA,
+    [DEC_TRAP] = Op_TRAP,
+};
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// runs at most `max_instructions` instructions off the predecoded cache.
+// the end of memory check is folded into `decode_at`, halting and interrupts
+// are only looked at after the instructions that can cause them.
+// `run_decode` and `run_instrumented` each get their own copy of this loop,
+// `run_decode` with `profile`, `trace`, `timeline` and `debugger` constant
+// NULL, so the counting, tracing, write logging and watchpoints are compiled
+// out of it
+static ALWAYS_INLINE Stop_Reason run_decode_loop(Machine* machine, Memory memory, uint64_t max_instructions, Profile* profile, Trace* trace, Timeline* timeline, Debugger* debugger) {
+#if !_DEBUGGER
+    (void)timeline;
+    (void)debugger;
+#endif
+    Stop_Reason reason = STOP_BUDGET;
+    Word* R = machine->registers;
+    uint64_t left = max_instructions;
+    if (left == 0) return reason;
+    if (!handle_events(machine, memory, &reason)) return reason;
+    if (trace != NULL && trace->replay) replay_interrupts(machine, memory);
+
+    Decoded resume;
+    Decoded* d = fetch_decoded(machine, memory);
+    if (d->kind == DEC_BREAKPOINT) {
+        // continuing from a breakpoint runs the instruction under it
+        resume = decode_table[read_memory(memory, machine->PC)];
+        d = &resume;
+    }
+    goto execute;
+
+    while (left > 0) {
+        if (trace != NULL && trace->replay) replay_interrupts(machine, memory);
+        // the hit is spelled out here, so it stays inline in both copies of the loop
+        d = &machine->decoded[machine->PC];
+        if (d->kind == DEC_MISS) d = fetch_decoded(machine, memory);
+    execute:
+#if _DEBUGGER
+        if (debugger != NULL && !(left == max_instructions && (machine->resuming & RESUME_WATCHPOINT)) &&
+            hits_watchpoint(machine, memory, d)) {
+            reason = STOP_WATCHPOINT;
+            goto out;
+        }
+#endif
+        if (profile != NULL && d->kind < DEC_BREAKPOINT) {
+            profile->executed[machine->PC]++;
+            profile->ops[dec_op[d->kind]]++;
+        }
+#if _DEBUGGER
+        if (timeline != NULL) timeline_step(timeline, machine->icount + (max_instructions - left), machine->PC);
+#endif
+        if (trace != NULL && d->kind < DEC_BREAKPOINT) {
+            if (!trace->replay) {
+                record_retire(trace, machine->PC);
+            } else if (!replay_retire(trace, machine->PC)) {
+                reason = STOP_TRACE_END;
+                goto out;
+            }
+        }
+        machine->PC++;
+        left--;
+        switch (d->kind) {
+            case DEC_BR: {
+                bool taken = (read_flags(machine) & d->r2) != 0;
+                if (profile != NULL) (taken ? profile->taken : profile->not_taken)[(uWord)(machine->PC - 1)]++;
+                if (taken) machine->PC += d->imm;
+            } break;
+            case DEC_SPIN: {
+                // taken, it branches to itself until an interrupt gets it
+                // out. the next chance for one is the next event, `run` never
+                // gives us a budget past it, so spinning would only burn the
+                // budget. with no event coming it can never be left at all
+                bool taken = (read_flags(machine) & d->r2) != 0;
+                if (profile != NULL) (taken ? profile->taken : profile->not_taken)[(uWord)(machine->PC - 1)]++;
+                if (!taken) break;
+                machine->PC--;
+                if (trace != NULL && trace->replay) {
+                    // the recording stopped here if the trace ends here, otherwise
+                    // it waited for whatever came next, which the trace has
+                    if (!replay_at_end(trace)) break;
+                    left++;
+                    reason = STOP_IDLE;
+                    goto out;
+                }
+                if (machine->next_event == EVENT_NEVER) {
+                    left++;
+                    reason = STOP_IDLE;
+                    goto out;
+                }
+                machine->idle = true;
+                left = 0;
+            } break;
+            case DEC_ADD_REG: {
+                Word result = R[d->r1] + R[d->r2];
+                set_flags_from_result(machine, result);
+                R[d->r0] = result;
+            } break;
+            case DEC_ADD_IMM: {
+                Word result = R[d->r1] + d->imm;
+                set_flags_from_result(machine, result);
+                R[d->r0] = result;
+            } break;
+            case DEC_AND_REG: {
+                Word result = R[d->r1] & R[d->r2];
+                set_flags_from_result(machine, result);
+                R[d->r0] = result;
+            } break;
+            case DEC_AND_IMM: {
+                Word result = R[d->r1] & d->imm;
+                set_flags_from_result(machine, result);
+                R[d->r0] = result;
+            } break;
+            case DEC_NOT: {
+                Word result = ~R[d->r1];
+                set_flags_from_result(machine, result);
+                R[d->r0] = result;
+            } break;
+            case DEC_JMP: {
+                machine->PC = R[d->r1];
+            } break;
+            case DEC_JSR: {
+                R[7] = machine->PC;
+                machine->PC += d->imm;
+            } break;
+            case DEC_JSRR: {
+                R[7] = machine->PC;
+                machine->PC = R[d->r1];
+            } break;
+            case DEC_LD: {
+                Word result = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+                R[d->r0] = result;
+                set_flags_from_result(machine, result);
+            } break;
+            case DEC_LDI: {
+                uWord addr = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+                Word result = load_memory(machine, memory, addr);
+                R[d->r0] = result;
+                set_flags_from_result(machine, result);
+            } break;
+            case DEC_LDR: {
+                Word result = load_memory(machine, memory, (uWord)(R[d->r1] + d->imm));
+                R[d->r0] = result;
+                set_flags_from_result(machine, result);
+            } break;
+            case DEC_LEA: {
+                Word result = machine->PC + d->imm;
+                R[d->r0] = result;
+                set_flags_from_result(machine, result);
+            } break;
+            case DEC_ST: {
+                write_memory(machine, memory, machine->PC + d->imm, R[d->r0]);
+                if (machine->event && !handle_events(machine, memory, &reason)) goto out;
+            } break;
+            case DEC_STI: {
+                uWord addr = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+                write_memory(machine, memory, addr, R[d->r0]);
+                if (machine->event && !handle_events(machine, memory, &reason)) goto out;
+            } break;
+            case DEC_STR: {
+                write_memory(machine, memory, R[d->r1] + d->imm, R[d->r0]);
+                if (machine->event && !handle_events(machine, memory, &reason)) goto out;
+            } break;
+            case DEC_RTI: {
+                op_rti(d->imm, machine, memory);
+                if (machine->event && !handle_events(machine, memory, &reason)) goto out;
+            } break;
+            case DEC_TRAP: {
+                op_trap(d->imm, machine, memory);
+                if (machine->event && !handle_events(machine, memory, &reason)) goto out;
+            } break;
+            case DEC_RES: {
+                reason = STOP_ILLEGAL_OPCODE;
+                goto out;
+            } break;
+            case DEC_BREAKPOINT: {
+                machine->PC--;
+                left++;
+                reason = STOP_BREAKPOINT;
+                goto out;
+            } break;
+            case DEC_END_OF_MEMORY: {
+                machine->PC--;
+                left++;
+                reason = STOP_END_OF_MEMORY;
+                goto out;
+            } break;
+            default: {
+                assert(false && "unreachable");
+            } break;
+        }
+    }
+out:
+    machine->icount += max_instructions - left;
+    return reason;
+}
+
+Stop_Reason run_decode(Machine* machine, Memory memory, uint64_t max_instructions) {
+    return run_decode_loop(machine, memory, max_instructions, NULL, NULL, NULL, NULL);
+}
+
+// the decode loop with the -profile counters, the trace hooks and the -debug
+// write log and watchpoints, `run_engine` picks it over the machine's engine
+// while any is on
+Stop_Reason run_instrumented(Machine* machine, Memory memory, uint64_t max_instructions) {
+#if _DEBUGGER
+    return run_decode_loop(machine, memory, max_instructions, machine->profile, machine->trace, machine->timeline, machine->debugger);
+#else
+    return run_decode_loop(machine, memory, max_instructions, machine->profile, machine->trace, NULL, NULL);
+#endif
+}
+
+typedef struct {
+    uWord addr;
+    uWord end;       // last address of a loop
+    uint64_t count;
+} Profile_Entry;
+
+int compare_profile_entries(const void* a, const void* b) {
+    uint64_t x = ((const Profile_Entry*)a)->count;
+    uint64_t y = ((const Profile_Entry*)b)->count;
+    return (x < y) - (x > y);
+}
+
+#define PROFILE_TOP 10
+
+double percent(uint64_t count, uint64_t total) {
+    return total == 0 ? 0.0 : 100.0 * (double)count / (double)total;
+}
+
+// the hottest addresses, the hottest loops closed by a backward BR (with the
+// instructions retired inside them) and the opcode mix
+void print_profile(const Profile* profile, Memory memory, FILE* file) {
+    uint64_t total = 0;
+    for (int op = 0; op <= Op_TRAP; op++) total += profile->ops[op];
+    fprintf(file, "profile: %llu instructions retired\n", (unsigned long long)total);
+
+    Profile_Entry* entries = malloc(MEMORY_SIZE * sizeof(*entries));
+    size_t count = 0;
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (profile->executed[addr] == 0) continue;
+        entries[count++] = (Profile_Entry){ .addr = addr, .end = addr, .count = profile->executed[addr] };
+    }
+    qsort(entries, count, sizeof(*entries), compare_profile_entries);
+    fprintf(file, "hot addresses:\n");
+    for (size_t i = 0; i < count && i < PROFILE_TOP; i++) {
+        Instruction inst = read_memory(memory, entries[i].addr);
+        fprintf(file, "    x%04X  %-8s %12llu  %5.1f%%\n", entries[i].addr, op_name[inst >> 12],
+                (unsigned long long)entries[i].count, percent(entries[i].count, total));
+    }
+
+    // a loop is the range from a backward BR's target to the BR itself
+    count = 0;
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (profile->taken[addr] == 0) continue;
+        Decoded d = decode_table[read_memory(memory, addr)];
+        if ((d.kind != DEC_BR && d.kind != DEC_SPIN) || d.imm >= 0) continue;
+        uWord begin = addr + 1 + d.imm;
+        if (begin > addr) continue;
+        uint64_t body = 0;
+        for (size_t at = begin; at <= addr; at++) body += profile->executed[at];
+        entries[count++] = (Profile_Entry){ .addr = begin, .end = addr, .count = body };
+    }
+    qsort(entries, count, sizeof(*entries), compare_profile_entries);
+    fprintf(file, "hot loops:\n");
+    for (size_t i = 0; i < count && i < PROFILE_TOP; i++) {
+        uWord site = entries[i].end;
+        fprintf(file, "    x%04X-x%04X %12llu  %5.1f%%  taken %llu, not taken %llu\n", entries[i].addr, site,
+                (unsigned long long)entries[i].count, percent(entries[i].count, total),
+                (unsigned long long)profile->taken[site], (unsigned long long)profile->not_taken[site]);
+    }
+    free(entries);
+
+    fprintf(file, "opcode mix:\n");
+    for (int op = 0; op <= Op_TRAP; op++) {
+        if (profile->ops[op] == 0) continue;
+        fprintf(file, "    %-8s %12llu  %5.1f%%\n", op_name[op], (unsigned long long)profile->ops[op], percent(profile->ops[op], total));
+    }
+}
+
+Machine init_machine() {
+    Machine machine = {0};
+    machine.PSR |= PSR_BIT_Z;
+    machine.cc_result = CC_IN_PSR;
+    machine.SSP = MEM_OSSPC_END;            // init supervisor stack
+    machine.decoded = calloc(MEMORY_SIZE, sizeof(*machine.decoded));
+    for (int kind = 0; kind < EVENT_COUNT; kind++) machine.deadline[kind] = EVENT_NEVER;
+    machine.next_event = EVENT_NEVER;
+    init_decode_table();
+    return machine;
+}
+
+void free_machine(Machine* machine) {
+    if (machine->io != NULL) {
+        for (int i = 0; i < machine->io->device_count; i++) free(machine->io->devices[i].state);
+        free(machine->io);
+        machine->io = NULL;
+    }
+    free(machine->decoded);
+    free(machine->breakpoints);
+    free(machine->profile);
+    if (machine->jit != NULL) jit_free(machine->jit);
+    machine->decoded = NULL;
+    machine->breakpoints = NULL;
+    machine->profile = NULL;
+    machine->jit = NULL;
+#if _DEBUGGER
+    if (machine->timeline != NULL) free_timeline(machine->timeline);
+    if (machine->debugger != NULL) free_debugger(machine->debugger);
+    machine->timeline = NULL;
+    machine->debugger = NULL;
+#endif
+}
+
+// a second machine in the same state, pair it with `fork_memory`. a machine
+// with devices gets its own standard ones, in the state its devices are in,
+// the same way `restore_snapshot` puts them back
+Machine fork_machine(const Machine* machine) {
+    Machine fork = init_machine();
+    copy_cpu_state(&fork, machine);
+    fork.engine = machine->engine;
+    fork.translated = machine->translated;
+    fork.hle = machine->hle;
+    if (machine->io != NULL) {
+        attach_standard_devices(&fork);
+        uint8_t* saved = save_devices(machine);
+        load_devices(&fork, saved);
+        free(saved);
+    }
+    return fork;
+}
+
+// second interpreter core, every handler ends in its own indirect jump to
+// the next handler instead of going back through one shared `switch`, which
+// gives the branch predictor one history per opcode. uses computed goto on
+// gcc/clang and falls back to a plain `switch` everywhere else. has to stay
+// bit exact with `run_decode`
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH 1
+#endif
+
+#ifdef THREADED_DISPATCH
+#define TARGET(kind) case kind: target_##kind
+#define DISPATCH() goto *dispatch_table[d->kind]
+#else
+#define TARGET(kind) case kind
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT_INSTRUCTION()                                  \
+    do {                                                    \
+        if (left == 0) goto out;                            \
+        left--;                                             \
+        d = &machine->decoded[machine->PC++];               \
+        DISPATCH();                                         \
+    } while (0)
+
+#define CHECK_EVENTS()                                                      \
+    do {                                                                    \
+        if (machine->event && !handle_events(machine, memory, &reason)) {   \
+            goto out;                                                       \
+        }                                                                   \
+    } while (0)
+
+Stop_Reason run_threaded(Machine* machine, Memory memory, uint64_t max_instructions) {
+#ifdef THREADED_DISPATCH
+    static const void* dispatch_table[DEC_COUNT] = {
+        [DEC_MISS]    = &&target_DEC_MISS,
+        [DEC_BR]      = &&target_DEC_BR,
+        [DEC_ADD_REG] = &&target_DEC_ADD_REG,
+        [DEC_ADD_IMM] = &&target_DEC_ADD_IMM,
+        [DEC_LD]      = &&target_DEC_LD,
+        [DEC_ST]      = &&target_DEC_ST,
+        [DEC_JSR]     = &&target_DEC_JSR,
+        [DEC_JSRR]    = &&target_DEC_JSRR,
+        [DEC_AND_REG] = &&target_DEC_AND_REG,
+        [DEC_AND_IMM] = &&target_DEC_AND_IMM,
+        [DEC_LDR]     = &&target_DEC_LDR,
+        [DEC_STR]     = &&target_DEC_STR,
+        [DEC_RTI]     = &&target_DEC_RTI,
+        [DEC_NOT]     = &&target_DEC_NOT,
+        [DEC_LDI]     = &&target_DEC_LDI,
+        [DEC_STI]     = &&target_DEC_STI,
+        [DEC_JMP]     = &&target_DEC_JMP,
+        [DEC_RES]     = &&target_DEC_RES,
+        [DEC_LEA]     = &&target_DEC_LEA,
+        [DEC_TRAP]    = &&target_DEC_TRAP,
+        [DEC_SPIN]    = &&target_DEC_SPIN,
+        [DEC_BREAKPOINT]    = &&target_DEC_BREAKPOINT,
+        [DEC_END_OF_MEMORY] = &&target_DEC_END_OF_MEMORY,
+    };
+#endif
+    Stop_Reason reason = STOP_BUDGET;
+    Word* R = machine->registers;
+    uint64_t left = max_instructions;
+    if (left == 0) return reason;
+    if (!handle_events(machine, memory, &reason)) return reason;
+
+    Decoded resume;
+    Decoded* d = fetch_decoded(machine, memory);
+    if (d->kind == DEC_BREAKPOINT) {
+        resume = decode_table[read_memory(memory, machine->PC)];
+        d = &resume;
+    }
+    machine->PC++;
+    left--;
+    DISPATCH();
+#ifndef THREADED_DISPATCH
+dispatch:
+#endif
+    switch (d->kind) {
+        TARGET(DEC_MISS): {
+            *d = decode_at(machine, memory, machine->PC - 1);
+            DISPATCH();
+        }
+        TARGET(DEC_BR): {
+            if ((read_flags(machine) & d->r2) != 0) machine->PC += d->imm;
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_ADD_REG): {
+            Word result = R[d->r1] + R[d->r2];
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_ADD_IMM): {
+            Word result = R[d->r1] + d->imm;
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_AND_REG): {
+            Word result = R[d->r1] & R[d->r2];
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_AND_IMM): {
+            Word result = R[d->r1] & d->imm;
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_NOT): {
+            Word result = ~R[d->r1];
+            set_flags_from_result(machine, result);
+            R[d->r0] = result;
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_JMP): {
+            machine->PC = R[d->r1];
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_JSR): {
+            R[7] = machine->PC;
+            machine->PC += d->imm;
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_JSRR): {
+            R[7] = machine->PC;
+            machine->PC = R[d->r1];
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_LD): {
+            Word result = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_LDI): {
+            uWord addr = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+            Word result = load_memory(machine, memory, addr);
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_LDR): {
+            Word result = load_memory(machine, memory, (uWord)(R[d->r1] + d->imm));
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_LEA): {
+            Word result = machine->PC + d->imm;
+            R[d->r0] = result;
+            set_flags_from_result(machine, result);
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_ST): {
+            write_memory(machine, memory, machine->PC + d->imm, R[d->r0]);
+            CHECK_EVENTS();
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_STI): {
+            uWord addr = load_memory(machine, memory, (uWord)(machine->PC + d->imm));
+            write_memory(machine, memory, addr, R[d->r0]);
+            CHECK_EVENTS();
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_STR): {
+            write_memory(machine, memory, R[d->r1] + d->imm, R[d->r0]);
+            CHECK_EVENTS();
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_RTI): {
+            op_rti(d->imm, machine, memory);
+            CHECK_EVENTS();
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_TRAP): {
+            op_trap(d->imm, machine, memory);
+            CHECK_EVENTS();
+            NEXT_INSTRUCTION();
+        }
+        TARGET(DEC_SPIN): {
+            if ((read_flags(machine) & d->r2) == 0) NEXT_INSTRUCTION();
+            machine->PC--;
+            if (machine->next_event == EVENT_NEVER) {
+                left++;
+                reason = STOP_IDLE;
+                goto out;
+            }
+            machine->idle = true;
+            left = 0;
+            goto out;
+        }
+        TARGET(DEC_RES): {
+            reason = STOP_ILLEGAL_OPCODE;
+            goto out;
+        }
+        TARGET(DEC_BREAKPOINT): {
+            machine->PC--;
+            left++;
+            reason = STOP_BREAKPOINT;
+            goto out;
+        }
+        TARGET(DEC_END_OF_MEMORY): {
+            machine->PC--;
+            left++;
+            reason = STOP_END_OF_MEMORY;
+            goto out;
+        }
+        default: {
+            assert(false && "unreachable");
+        }
+    }
+out:
+    machine->icount += max_instructions - left;
+    return reason;
+}
+
+#undef CHECK_EVENTS
+#undef NEXT_INSTRUCTION
+#undef DISPATCH
+#undef TARGET
+
+// basic block JIT for x86-64
+//
+// a block starts at the current PC and runs until a BR/JMP/JSR/JSRR (which
+// are translated and end the block) or until a TRAP/RTI/illegal opcode
+// (which are not translated, the block just stops in front of them and the
+// interpreter takes over). inside a block the eight guest registers live in
+// r8d-r15d, only the low 16 bits mean anything.
+//
+// anything the block cant do on its own leaves through a side exit: the
+// registers and the flags are written back, PC points at the instruction that
+// caused it and the dispatcher interprets exactly that one instruction. this
+// is what happens for loads/stores that land in the I/O page (0xFE00-0xFFFF)
+// and for stores into a page that holds translated code, so invalidation
+// always happens in `write_memory`, never from native code.
+#ifdef JIT_SUPPORTED
+
+#define JIT_CODE_CAPACITY  (8 << 20)
+#define JIT_MAX_BLOCK_LEN  64
+#define JIT_MAX_BLOCK_CODE (16 << 10) // worst case for one block, with its side exits
+#define JIT_PAGE_BITS      8
+#define JIT_PAGE_COUNT     (MEMORY_SIZE >> JIT_PAGE_BITS)
+#define JIT_NO_BLOCK       ((uint8_t*)1)  // tried, nothing to translate at this address
+
+typedef enum {
+    JIT_EXIT_NEXT      = 0, // PC is the next instruction, carry on
+    JIT_EXIT_INTERPRET = 1, // PC is an instruction the block could not run
+} Jit_Exit;
+
+// returns the number of retired instructions shifted left by one, or'ed with a Jit_Exit
+typedef int (*Jit_Block_Fn)(Machine* machine, Guest_Memory* memory, const uint8_t* page_has_code);
+
+typedef struct {
+    size_t fixups[3]; // rel32 jumps that have to land on this exit
+    int    fixup_count;
+    uWord  pc;
+    int    flag_reg;
+    int    retired;
+} Jit_Side_Exit;
+
+struct Jit {
+    uint8_t*  code;
+    size_t    used;
+    size_t    capacity;
+    uint8_t** entry;  // native entry point for a block starting at that address
+    uWord*    end;    // last address covered by the block starting at that address
+    uint8_t   page_has_code[JIT_PAGE_COUNT];
+
+    // state of the block being translated
+    size_t        epilogue;
+    int           flag_reg; // guest register holding the last flag producing result, -1 for none
+    int           retired;  // instructions translated so far, all of them retired at the next exit
+    Jit_Side_Exit exits[JIT_MAX_BLOCK_LEN];
+    int           exit_count;
+};
+
+enum {
+    HOST_RAX, HOST_RCX, HOST_RDX, HOST_RBX, HOST_RSP, HOST_RBP, HOST_RSI, HOST_RDI,
+    HOST_R8,  HOST_R9,  HOST_R10, HOST_R11, HOST_R12, HOST_R13, HOST_R14, HOST_R15,
+};
+
+#define HOST_NO_INDEX HOST_RSP
+#define GUEST_REG(i)  (HOST_R8 + (i))
+
+// opcode flags, the low 16 bits are the opcode itself (0x0Fxx for two byte ones)
+#define OP16 0x10000 // operand size prefix
+#define OPW  0x20000 // REX.W
+
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xC
+#define CC_G  0xF
+
+#define MACHINE_REG_OFFSET(i) ((int32_t)(offsetof(Machine, registers) + (i) * sizeof(Word)))
+#define MACHINE_PC_OFFSET     ((int32_t)offsetof(Machine, PC))
+#define MACHINE_PSR_OFFSET    ((int32_t)offsetof(Machine, PSR))
+#define MACHINE_CC_OFFSET     ((int32_t)offsetof(Machine, cc_result))
+#define MACHINE_DECODED_OFFSET ((int32_t)offsetof(Machine, decoded))
+#define MEMORY_PAGES_OFFSET    ((int32_t)offsetof(Guest_Memory, pages))
+#define MEMORY_WRITABLE_OFFSET ((int32_t)offsetof(Guest_Memory, writable))
+#define PAGE_WORDS_OFFSET      ((int32_t)offsetof(Page, words))
+
+// native stores clear the decoded entry themselves, as `write_memory` would
+_Static_assert(sizeof(Decoded) == 6 && offsetof(Decoded, kind) == 0, "jit assumes a 6 byte Decoded");
+// stores test the writable bit with one 64 bit `bt`
+_Static_assert(WRITABLE_WORD_BITS == 64, "jit assumes 64 writable bits per word");
+
+void jit_byte(Jit* jit, uint8_t byte) {
+    jit->code[jit->used++] = byte;
+}
+
+void jit_u16(Jit* jit, uint16_t value) {
+    memcpy(jit->code + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+void jit_u32(Jit* jit, uint32_t value) {
+    memcpy(jit->code + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+void jit_prefix(Jit* jit, uint32_t opcode, int reg, int index, int base) {
+    if (opcode & OP16) jit_byte(jit, 0x66);
+    uint8_t rex = 0x40 | ((opcode & OPW) ? 0b1000 : 0)
+                | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40) jit_byte(jit, rex);
+    if ((opcode & 0xFFFF) > 0xFF) jit_byte(jit, (opcode >> 8) & 0xFF);
+    jit_byte(jit, opcode & 0xFF);
+}
+
+// `op reg, rm` with both operands registers
+void jit_rr(Jit* jit, uint32_t opcode, int reg, int rm) {
+    jit_prefix(jit, opcode, reg, 0, rm);
+    jit_byte(jit, 0b11000000 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// `op reg, [base + index*(1 << scale) + disp]`, always encoded with a SIB and a disp32
+void jit_rm(Jit* jit, uint32_t opcode, int reg, int base, int index, int scale, int32_t disp) {
+    jit_prefix(jit, opcode, reg, index, base);
+    jit_byte(jit, 0b10000000 | ((reg & 7) << 3) | 0b100);
+    jit_byte(jit, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    jit_u32(jit, disp);
+}
+
+// `op rm, imm32` from the 0x81 group, `ext` picks add/and/cmp...
+void jit_ri(Jit* jit, int ext, int rm, int32_t imm) {
+    jit_rr(jit, 0x81, ext, rm);
+    jit_u32(jit, imm);
+}
+
+void jit_mov_imm(Jit* jit, int reg, uint32_t imm) {
+    jit_prefix(jit, 0xB8 + (reg & 7), 0, 0, reg);
+    jit_u32(jit, imm);
+}
+
+// emits a jump with a zero rel32 and returns where to patch it
+size_t jit_jcc(Jit* jit, int cc) {
+    jit_byte(jit, 0x0F);
+    jit_byte(jit, 0x80 | cc);
+    jit_u32(jit, 0);
+    return jit->used - 4;
+}
+
+void jit_patch(Jit* jit, size_t fixup, size_t target) {
+    int32_t rel = (int32_t)(target - (fixup + 4));
+    memcpy(jit->code + fixup, &rel, sizeof(rel));
+}
+
+void jit_jmp_to(Jit* jit, size_t target) {
+    jit_byte(jit, 0xE9);
+    jit_u32(jit, 0);
+    jit_patch(jit, jit->used - 4, target);
+}
+
+// records the value in guest register `reg` as the last flag setting result,
+// the flags themselves stay lazy, see `sync_flags`. clobbers eax
+void jit_emit_flags(Jit* jit, int reg) {
+    jit_rr(jit, 0x0FB7, HOST_RAX, GUEST_REG(reg));           // movzx eax, rN16
+    jit_rm(jit, 0x89, HOST_RAX, HOST_RBX, HOST_NO_INDEX, 0, MACHINE_CC_OFFSET);
+}
+
+// puts the N Z P bits for the value in guest register `reg` in ecx, same
+// bits `flags_from_result` gives. clobbers eax, edx
+void jit_emit_nzp(Jit* jit, int reg) {
+    jit_rr(jit, 0x0FBF, HOST_RAX, GUEST_REG(reg));           // movsx eax, rN16
+    jit_rr(jit, 0x31, HOST_RCX, HOST_RCX);                   // xor ecx, ecx
+    jit_rr(jit, 0x31, HOST_RDX, HOST_RDX);                   // xor edx, edx
+    jit_rr(jit, 0x85, HOST_RAX, HOST_RAX);                   // test eax, eax
+    jit_rr(jit, 0x0F90 | CC_G, 0, HOST_RCX);                 // setg cl
+    jit_rr(jit, 0x0F90 | CC_E, 0, HOST_RDX);                 // sete dl
+    jit_rm(jit, 0x8D, HOST_RCX, HOST_RCX, HOST_RDX, 1, 0);   // lea ecx, [rcx + rdx*2]
+    jit_rr(jit, 0x0F90 | CC_L, 0, HOST_RDX);                 // setl dl
+    jit_rm(jit, 0x8D, HOST_RCX, HOST_RCX, HOST_RDX, 2, 0);   // lea ecx, [rcx + rdx*4]
+}
+
+void jit_emit_set_pc(Jit* jit, uWord pc) {
+    jit_rm(jit, OP16 | 0xC7, 0, HOST_RBX, HOST_NO_INDEX, 0, MACHINE_PC_OFFSET);
+    jit_u16(jit, pc);
+}
+
+// leaves the block with the next PC already written to the machine
+void jit_emit_exit(Jit* jit, Jit_Exit status, int retired) {
+    jit_mov_imm(jit, HOST_RAX, (retired << 1) | status);
+    jit_jmp_to(jit, jit->epilogue);
+}
+
+void jit_emit_flush_flags(Jit* jit) {
+    if (jit->flag_reg >= 0) jit_emit_flags(jit, jit->flag_reg);
+}
+
+Jit_Side_Exit* jit_side_exit(Jit* jit, uWord pc) {
+    Jit_Side_Exit* side_exit = &jit->exits[jit->exit_count++];
+    side_exit->fixup_count = 0;
+    side_exit->pc = pc;
+    side_exit->flag_reg = jit->flag_reg;
+    side_exit->retired = jit->retired;
+    return side_exit;
+}
+
+void jit_side_exit_on(Jit* jit, Jit_Side_Exit* side_exit, int cc) {
+    side_exit->fixups[side_exit->fixup_count++] = jit_jcc(jit, cc);
+}
+
+// eax holds a 16 bit guest address, leave if it points into the I/O page
+void jit_emit_check_io(Jit* jit, Jit_Side_Exit* side_exit) {
+    jit_ri(jit, 7, HOST_RAX, MEM_IOREG_BEGIN);               // cmp eax, 0xFE00
+    jit_side_exit_on(jit, side_exit, CC_AE);
+}
+
+// eax holds a 16 bit guest address about to be stored to, leave if it points
+// into a page with translated code
+void jit_emit_check_code_page(Jit* jit, Jit_Side_Exit* side_exit) {
+    jit_rr(jit, 0x89, HOST_RAX, HOST_RCX);                   // mov ecx, eax
+    jit_rr(jit, 0xC1, 5, HOST_RCX);                          // shr ecx, JIT_PAGE_BITS
+    jit_byte(jit, JIT_PAGE_BITS);
+    jit_rm(jit, 0x80, 7, HOST_RDI, HOST_RCX, 0, 0);          // cmp byte [rdi + rcx], 0
+    jit_byte(jit, 0);
+    jit_side_exit_on(jit, side_exit, CC_NE);
+}
+
+// guest memory is reached through the Guest_Memory in rbp, rcx and rdx are scratch
+void jit_emit_load_const(Jit* jit, int host_reg, uWord addr) {
+    jit_rm(jit, OPW | 0x8B, HOST_RCX, HOST_RBP, HOST_NO_INDEX, 0,
+           MEMORY_PAGES_OFFSET + (addr >> PAGE_BITS) * (int32_t)sizeof(Page*));
+    jit_rm(jit, 0x0FB7, host_reg, HOST_RCX, HOST_NO_INDEX, 0, PAGE_WORDS_OFFSET + (addr & PAGE_MASK) * sizeof(uWord));
+}
+
+// eax holds a 16 bit guest address, ecx gets its page number
+void jit_emit_page_index(Jit* jit) {
+    jit_rr(jit, 0x89, HOST_RAX, HOST_RCX);                   // mov ecx, eax
+    jit_rr(jit, 0xC1, 5, HOST_RCX);                          // shr ecx, PAGE_BITS
+    jit_byte(jit, PAGE_BITS);
+}
+
+// ecx holds a page number, leaves that page in rcx and the offset of eax in edx
+void jit_emit_page_lookup(Jit* jit) {
+    jit_rm(jit, OPW | 0x8B, HOST_RCX, HOST_RBP, HOST_RCX, 3, MEMORY_PAGES_OFFSET); // mov rcx, [rbp + rcx*8 + pages]
+    jit_rr(jit, 0x0FB6, HOST_RDX, HOST_RAX);                 // movzx edx, al
+}
+
+// translates one instruction at `pc`, returns false when the block has to
+// stop in front of it. sets `*terminated` for instructions that end a block
+bool jit_emit_instruction(Jit* jit, const Decoded* d, uWord pc, bool* terminated) {
+    uWord next = pc + 1;
+    int dr = GUEST_REG(d->r0);
+    int sr1 = GUEST_REG(d->r1);
+    int sr2 = GUEST_REG(d->r2);
+    switch (d->kind) {
+        case DEC_ADD_REG: case DEC_AND_REG: {
+            jit_rr(jit, 0x89, sr1, HOST_RAX);                    // mov eax, sr1
+            jit_rr(jit, d->kind == DEC_ADD_REG ? 0x01 : 0x21, sr2, HOST_RAX);
+            jit_rr(jit, 0x89, HOST_RAX, dr);
+            jit->flag_reg = d->r0;
+        } break;
+        case DEC_ADD_IMM: case DEC_AND_IMM: {
+            jit_rr(jit, 0x89, sr1, HOST_RAX);
+            jit_ri(jit, d->kind == DEC_ADD_IMM ? 0 : 4, HOST_RAX, d->imm);
+            jit_rr(jit, 0x89, HOST_RAX, dr);
+            jit->flag_reg = d->r0;
+        } break;
+        case DEC_NOT: {
+            jit_rr(jit, 0x89, sr1, HOST_RAX);
+            jit_rr(jit, 0xF7, 2, HOST_RAX);                      // not eax
+            jit_rr(jit, 0x89, HOST_RAX, dr);
+            jit->flag_reg = d->r0;
+        } break;
+        case DEC_LEA: {
+            jit_mov_imm(jit, dr, (uWord)(next + d->imm));
+            jit->flag_reg = d->r0;
+        } break;
+        case DEC_LD: {
+            uWord addr = next + d->imm;
+            if (addr >= MEM_IOREG_BEGIN) return false;
+            jit_emit_load_const(jit, dr, addr);
+            jit->flag_reg = d->r0;
+        } break;
+        case DEC_LDI: case DEC_LDR: {
+            if (d->kind == DEC_LDI) {
+                uWord ptr = next + d->imm;
+                if (ptr >= MEM_IOREG_BEGIN) return false;
+                jit_emit_load_const(jit, HOST_RAX, ptr);
+            } else {
+                jit_rr(jit, 0x89, sr1, HOST_RAX);
+                jit_ri(jit, 0, HOST_RAX, d->imm);
+                jit_rr(jit, 0x0FB7, HOST_RAX, HOST_RAX);         // movzx eax, ax
+            }
+            jit_emit_check_io(jit, jit_side_exit(jit, pc));
+            jit_emit_page_index(jit);
+            jit_emit_page_lookup(jit);
+            jit_rm(jit, 0x0FB7, dr, HOST_RCX, HOST_RDX, 1, PAGE_WORDS_OFFSET); // movzx dr, word [rcx + rdx*2 + words]
+            jit->flag_reg = d->r0;
+        } break;
+        case DEC_ST: case DEC_STI: case DEC_STR: {
+            Jit_Side_Exit* side_exit = NULL;
+            if (d->kind == DEC_ST) {
+                uWord addr = next + d->imm;
+                if (addr >= MEM_IOREG_BEGIN) return false;
+                jit_mov_imm(jit, HOST_RAX, addr);
+            } else if (d->kind == DEC_STI) {
+                uWord ptr = next + d->imm;
+                if (ptr >= MEM_IOREG_BEGIN) return false;
+                jit_emit_load_const(jit, HOST_RAX, ptr);
+                side_exit = jit_side_exit(jit, pc);
+                jit_emit_check_io(jit, side_exit);
+            } else {
+                jit_rr(jit, 0x89, sr1, HOST_RAX);
+                jit_ri(jit, 0, HOST_RAX, d->imm);
+                jit_rr(jit, 0x0FB7, HOST_RAX, HOST_RAX);
+                side_exit = jit_side_exit(jit, pc);
+                jit_emit_check_io(jit, side_exit);
+            }
+            if (side_exit == NULL) side_exit = jit_side_exit(jit, pc);
+            jit_emit_check_code_page(jit, side_exit);
+            jit_emit_page_index(jit);
+            jit_rr(jit, 0x89, HOST_RCX, HOST_RDX);                  // mov edx, ecx
+            jit_rr(jit, 0xC1, 5, HOST_RDX);                         // shr edx, 6
+            jit_byte(jit, 6);
+            jit_rm(jit, OPW | 0x8B, HOST_RDX, HOST_RBP, HOST_RDX, 3, MEMORY_WRITABLE_OFFSET);
+            jit_rr(jit, OPW | 0x0FA3, HOST_RCX, HOST_RDX);          // bt rdx, rcx
+            jit_side_exit_on(jit, side_exit, CC_AE);                // shared page, copy it first
+            jit_emit_page_lookup(jit);
+            jit_rm(jit, OP16 | 0x89, dr, HOST_RCX, HOST_RDX, 1, PAGE_WORDS_OFFSET); // mov word [rcx + rdx*2 + words], dr16
+            jit_rm(jit, 0x8D, HOST_RCX, HOST_RAX, HOST_RAX, 1, 0);  // lea ecx, [rax + rax*2]
+            jit_rm(jit, 0xC6, 0, HOST_RSI, HOST_RCX, 1, 0);         // mov byte [rsi + rcx*2], DEC_MISS
+            jit_byte(jit, DEC_MISS);
+        } break;
+        case DEC_BR: {
+            if (d->r2 == 0) break; // never taken, just a nop
+            if (d->r2 == 0b111 && jit->flag_reg >= 0) {
+                // a result always sets one flag. PSR itself can hold none
+                // after an RTI, so nzp is only unconditional here
+                jit_emit_flush_flags(jit);
+                jit_emit_set_pc(jit, next + d->imm);
+            } else {
+                if (jit->flag_reg >= 0) {
+                    // flags come from this block, test them straight from the register
+                    jit_emit_nzp(jit, jit->flag_reg);
+                    jit_rr(jit, 0xF6, 0, HOST_RCX);
+                    jit_byte(jit, d->r2);                        // test cl, nzp
+                } else {
+                    // `run_jit` syncs the flags before entering a block
+                    jit_rm(jit, 0xF6, 0, HOST_RBX, HOST_NO_INDEX, 0, MACHINE_PSR_OFFSET);
+                    jit_byte(jit, d->r2);                        // test byte [PSR], nzp
+                }
+                jit_mov_imm(jit, HOST_RAX, next);                // mov doesnt touch the flags
+                jit_mov_imm(jit, HOST_RCX, (uWord)(next + d->imm));
+                jit_rr(jit, 0x0F40 | CC_NE, HOST_RAX, HOST_RCX); // cmovnz eax, ecx
+                jit_rm(jit, OP16 | 0x89, HOST_RAX, HOST_RBX, HOST_NO_INDEX, 0, MACHINE_PC_OFFSET);
+                jit_emit_flush_flags(jit);
+            }
+            jit_emit_exit(jit, JIT_EXIT_NEXT, jit->retired + 1);
+            *terminated = true;
+        } break;
+        case DEC_JMP: {
+            jit_emit_flush_flags(jit);
+            jit_rm(jit, OP16 | 0x89, sr1, HOST_RBX, HOST_NO_INDEX, 0, MACHINE_PC_OFFSET);
+            jit_emit_exit(jit, JIT_EXIT_NEXT, jit->retired + 1);
+            *terminated = true;
+        } break;
+        case DEC_JSR: case DEC_JSRR: {
+            jit_emit_flush_flags(jit);
+            jit_mov_imm(jit, GUEST_REG(7), next);
+            if (d->kind == DEC_JSR) {
+                jit_emit_set_pc(jit, next + d->imm);
+            } else {
+                jit_rm(jit, OP16 | 0x89, sr1, HOST_RBX, HOST_NO_INDEX, 0, MACHINE_PC_OFFSET);
+            }
+            jit_emit_exit(jit, JIT_EXIT_NEXT, jit->retired + 1);
+            *terminated = true;
+        } break;
+        default: {
+            // TRAP, RTI, spins and illegal opcodes are left to the interpreter
+            return false;
+        }
+    }
+    return true;
+}
+
+void jit_flush(Jit* jit) {
+    jit->used = 0;
+    memset(jit->entry, 0, MEMORY_SIZE * sizeof(*jit->entry));
+    memset(jit->page_has_code, 0, sizeof(jit->page_has_code));
+}
+
+Jit* jit_init() {
+    void* code = mmap(NULL, JIT_CODE_CAPACITY, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+
+    Jit* jit = calloc(1, sizeof(*jit));
+    jit->code = code;
+    jit->capacity = JIT_CODE_CAPACITY;
+    jit->entry = calloc(MEMORY_SIZE, sizeof(*jit->entry));
+    jit->end = calloc(MEMORY_SIZE, sizeof(*jit->end));
+    return jit;
+}
+
+void jit_free(Jit* jit) {
+    munmap(jit->code, jit->capacity);
+    free(jit->entry);
+    free(jit->end);
+    free(jit);
+}
+
+void jit_mark_pages(Jit* jit, uWord begin, uWord end) {
+    for (int page = begin >> JIT_PAGE_BITS; page <= (end >> JIT_PAGE_BITS); page++) {
+        jit->page_has_code[page] = 1;
+    }
+}
+
+uint8_t* jit_compile_block(Jit* jit, const Machine* machine, Memory memory, uWord start) {
+    if (jit->capacity - jit->used < JIT_MAX_BLOCK_CODE) jit_flush(jit);
+    size_t block_begin = jit->used;
+
+    // the shared exit sits in front of the entry so every jump to it is a
+    // backwards one with a known target
+    jit->epilogue = jit->used;
+    for (int i = 0; i < 8; i++) {
+        jit_rm(jit, OP16 | 0x89, GUEST_REG(i), HOST_RBX, HOST_NO_INDEX, 0, MACHINE_REG_OFFSET(i));
+    }
+    jit_prefix(jit, 0x58 + (HOST_R15 & 7), 0, 0, HOST_R15);
+    jit_prefix(jit, 0x58 + (HOST_R14 & 7), 0, 0, HOST_R14);
+    jit_prefix(jit, 0x58 + (HOST_R13 & 7), 0, 0, HOST_R13);
+    jit_prefix(jit, 0x58 + (HOST_R12 & 7), 0, 0, HOST_R12);
+    jit_byte(jit, 0x58 + HOST_RBP);
+    jit_byte(jit, 0x58 + HOST_RBX);
+    jit_byte(jit, 0xC3);
+
+    size_t entry = jit->used;
+    jit_byte(jit, 0x50 + HOST_RBX);
+    jit_byte(jit, 0x50 + HOST_RBP);
+    jit_prefix(jit, 0x50 + (HOST_R12 & 7), 0, 0, HOST_R12);
+    jit_prefix(jit, 0x50 + (HOST_R13 & 7), 0, 0, HOST_R13);
+    jit_prefix(jit, 0x50 + (HOST_R14 & 7), 0, 0, HOST_R14);
+    jit_prefix(jit, 0x50 + (HOST_R15 & 7), 0, 0, HOST_R15);
+    jit_rr(jit, OPW | 0x89, HOST_RDI, HOST_RBX);             // rbx = machine
+    jit_rr(jit, OPW | 0x89, HOST_RSI, HOST_RBP);             // rbp = memory
+    jit_rr(jit, OPW | 0x89, HOST_RDX, HOST_RDI);             // rdi = page_has_code
+    jit_rm(jit, OPW | 0x8B, HOST_RSI, HOST_RBX, HOST_NO_INDEX, 0, MACHINE_DECODED_OFFSET);
+    for (int i = 0; i < 8; i++) {
+        jit_rm(jit, 0x0FB7, GUEST_REG(i), HOST_RBX, HOST_NO_INDEX, 0, MACHINE_REG_OFFSET(i));
+    }
+
+    jit->flag_reg = -1;
+    jit->retired = 0;
+    jit->exit_count = 0;
+    uWord pc = start;
+    bool terminated = false;
+    while (jit->retired < JIT_MAX_BLOCK_LEN && pc < MEM_IOREG_BEGIN) {
+        if (pc != start && is_breakpoint(machine, pc)) break;
+        Decoded d = decode_table[read_memory(memory, pc)];
+        if (!jit_emit_instruction(jit, &d, pc, &terminated)) break;
+        jit->retired++;
+        pc++;
+        if (terminated) break;
+    }
+
+    if (jit->retired == 0) {
+        jit->used = block_begin;
+        jit->entry[start] = JIT_NO_BLOCK;
+        jit->end[start] = start;
+        jit_mark_pages(jit, start, start);
+        return JIT_NO_BLOCK;
+    }
+    if (!terminated) {
+        jit_emit_flush_flags(jit);
+        jit_emit_set_pc(jit, pc);
+        jit_emit_exit(jit, JIT_EXIT_NEXT, jit->retired);
+    }
+
+    for (int i = 0; i < jit->exit_count; i++) {
+        Jit_Side_Exit* side_exit = &jit->exits[i];
+        for (int f = 0; f < side_exit->fixup_count; f++) {
+            jit_patch(jit, side_exit->fixups[f], jit->used);
+        }
+        if (side_exit->flag_reg >= 0) jit_emit_flags(jit, side_exit->flag_reg);
+        jit_emit_set_pc(jit, side_exit->pc);
+        jit_emit_exit(jit, JIT_EXIT_INTERPRET, side_exit->retired);
+    }
+
+    uWord last = pc - 1;
+    jit->entry[start] = jit->code + entry;
+    jit->end[start] = last;
+    jit_mark_pages(jit, start, last);
+    return jit->entry[start];
+}
+
+// drops every block that covers the page `addr` is in. blocks are at most
+// JIT_MAX_BLOCK_LEN words long so only the page itself and the one in front
+// of it have to be scanned
+void jit_invalidate_write(Jit* jit, uWord addr) {
+    int page = addr >> JIT_PAGE_BITS;
+    if (!jit->page_has_code[page]) return;
+
+    size_t page_begin = (size_t)page << JIT_PAGE_BITS;
+    size_t page_end = page_begin + (1 << JIT_PAGE_BITS) - 1;
+    size_t scan_begin = page_begin >= (1 << JIT_PAGE_BITS) ? page_begin - (1 << JIT_PAGE_BITS) : 0;
+    for (size_t start = scan_begin; start <= page_end; start++) {
+        if (jit->entry[start] == NULL) continue;
+        if (jit->end[start] >= page_begin && start <= page_end) jit->entry[start] = NULL;
+    }
+    jit->page_has_code[page] = 0;
+}
+
+// blocks only run while the budget left covers a whole block, the rest and
+// everything a block stops in front of goes through `run_decode` one
+// instruction at a time, which is also where halting and interrupts are seen
+Stop_Reason run_jit(Machine* machine, Memory memory, uint64_t max_instructions) {
+    if (machine->jit == NULL) machine->jit = jit_init();
+    if (machine->jit == NULL) {
+        printf("[ERROR] could not map executable memory for the jit, using the interpreter\n");
+        machine->engine = ENGINE_DECODE;
+        return run_decode(machine, memory, max_instructions);
+    }
+    Jit* jit = machine->jit;
+
+    Stop_Reason reason = STOP_BUDGET;
+    uint64_t left = max_instructions;
+    if (left == 0) return reason;
+    if (!handle_events(machine, memory, &reason)) return reason;
+
+    bool first = true; // continuing from a breakpoint runs the instruction under it
+    bool interpret_next = false;
+    while (left > 0) {
+        if (!first && is_breakpoint(machine, machine->PC)) {
+            reason = STOP_BREAKPOINT;
+            break;
+        }
+        first = false;
+        if (!interpret_next && left >= JIT_MAX_BLOCK_LEN && machine->PC < MEM_IOREG_BEGIN) {
+            uint8_t* code = jit->entry[machine->PC];
+            if (code == NULL) code = jit_compile_block(jit, machine, memory, machine->PC);
+            if (code != JIT_NO_BLOCK) {
+                Jit_Block_Fn block = (Jit_Block_Fn)code;
+                sync_flags(machine);
+                int result = block(machine, memory, jit->page_has_code);
+                left -= result >> 1;
+                machine->icount += result >> 1;
+                interpret_next = (result & 1) == JIT_EXIT_INTERPRET;
+                continue;
+            }
+        }
+        interpret_next = false;
+        // a taken spin gets the whole budget, it skips straight to the end of it
+        Decoded d = decode_at(machine, memory, machine->PC);
+        bool spin = d.kind == DEC_SPIN && (read_flags(machine) & d.r2) != 0;
+        uint64_t before = machine->icount;
+        reason = run_decode(machine, memory, spin ? left : 1);
+        left -= machine->icount - before;
+        if (reason != STOP_BUDGET || machine->rescheduled != 0) return reason;
+    }
+    return reason;
+}
+
+#else
+
+void jit_invalidate_write(Jit* jit, uWord addr) {
+    (void)jit;
+    (void)addr;
+}
+
+void jit_free(Jit* jit) {
+    (void)jit;
+}
+
+Stop_Reason run_jit(Machine* machine, Memory memory, uint64_t max_instructions) {
+    printf("[ERROR] the jit is only available on x86-64, using the interpreter\n");
+    machine->engine = ENGINE_DECODE;
+    return run_decode(machine, memory, max_instructions);
+}
+
+#endif // JIT_SUPPORTED
+
+Stop_Reason run_engine(Machine* machine, Memory memory, uint64_t max_instructions) {
+    if (machine->profile != NULL || machine->trace != NULL) {
+        return run_instrumented(machine, memory, max_instructions);
+    }
+#if _DEBUGGER
+    if (machine->timeline != NULL || machine->debugger != NULL) {
+        return run_instrumented(machine, memory, max_instructions);
+    }
+#endif
+    switch (machine->engine) {
+        case ENGINE_DECODE:   return run_decode(machine, memory, max_instructions);
+        case ENGINE_THREADED: return run_threaded(machine, memory, max_instructions);
+        case ENGINE_JIT:      return run_jit(machine, memory, max_instructions);
+        case ENGINE_AOT:      return machine->translated(machine, memory, max_instructions);
+    }
+    assert(false && "unreachable");
+    return STOP_HALTED;
+}
+
+// runs the machine on its engine for at most `max_instructions` instructions,
+// RUN_FOREVER for no limit. the engine gets the budget in slices that end at
+// the next scheduled event, so nothing in the engines ever checks for timers
+// or devices, events are handled between the slices.
+// the engines run the instruction under a breakpoint they start on, so a
+// breakpoint at the start of a slice is looked at here. after a breakpoint or
+// watchpoint stop `machine->resuming` has it, and the next call goes through it
+Stop_Reason run(Machine* machine, Memory memory, uint64_t max_instructions) {
+    uint64_t left = max_instructions;
+    for (;;) {
+        update_schedule(machine);
+        if (!(machine->resuming & RESUME_BREAKPOINT) && is_breakpoint(machine, machine->PC) && breakpoint_stops(machine)) {
+            machine->resuming = RESUME_BREAKPOINT;
+            return STOP_BREAKPOINT;
+        }
+        uint64_t slice = left;
+        if (machine->next_event - machine->icount < slice) slice = machine->next_event - machine->icount;
+        uint64_t before = machine->icount;
+        Stop_Reason reason = run_engine(machine, memory, slice);
+        machine->resuming = 0;
+        if (left != RUN_FOREVER) left -= machine->icount - before;
+        if (reason == STOP_BREAKPOINT && !breakpoint_stops(machine)) reason = STOP_BUDGET;
+        if (reason == STOP_BREAKPOINT) machine->resuming = RESUME_BREAKPOINT;
+        if (reason == STOP_WATCHPOINT) machine->resuming = RESUME_BREAKPOINT | RESUME_WATCHPOINT;
+        if (reason != STOP_BUDGET || left == 0) {
+            update_schedule(machine);
+            return reason;
+        }
+    }
+}
+
+// what a plain run says about a stop, false when the program is over
+bool report_stop(const Machine* machine, Stop_Reason reason) {
+    switch (reason) {
+        case STOP_HALTED: return false;
+        case STOP_END_OF_MEMORY: {
+            printf("End of Memory Reached\n");
+            return false;
+        }
+        case STOP_IDLE: {
+            printf("Idle Loop Reached\n");
+            return false;
+        }
+        case STOP_TRACE_END: {
+            printf("End of Trace Reached\n");
+            return false;
+        }
+        case STOP_ILLEGAL_OPCODE: {
+            printf("[ERROR] Illegal Opcode\n");
+            printf("ERROR: Instruction no %u\n", machine->PC);
+        } break;
+        case STOP_BUDGET:
+        case STOP_BREAKPOINT:
+        case STOP_WATCHPOINT: break;
+    }
+    return true;
+}
+
+void execute_program(Machine* machine, Memory memory) {
+    for (;;) {
+        Stop_Reason reason = run(machine, memory, RUN_FOREVER);
+        console_sync(machine->console);
+        if (!report_stop(machine, reason)) return;
+    }
+}
+
+#if _DEBUGGER
+// -debug, an interactive session on stdin or a socket that can also go
+// backwards, see `Timeline`. time is `icount`
+
+void timeline_snapshot(Machine* machine, Memory memory) {
+    Timeline* timeline = machine->timeline;
+    if (timeline->snapshot_count > 0 && timeline->snapshots[timeline->snapshot_count - 1].cpu.icount >= machine->icount) return;
+    if (timeline->snapshot_count >= timeline->snapshot_capacity) {
+        timeline->snapshot_capacity = (timeline->snapshot_capacity + 1) * 2;
+        timeline->snapshots = realloc(timeline->snapshots, timeline->snapshot_capacity * sizeof(*timeline->snapshots));
+    }
+    timeline->snapshots[timeline->snapshot_count++] = take_snapshot(machine, memory);
+}
+
+// runs forward to `target` or the first stop before it. it goes in pieces
+// that end on the snapshot boundaries, and takes the snapshot the first time
+// one is reached. set `machine->resuming` to go through the stops under PC
+Stop_Reason timeline_run(Machine* machine, Memory memory, uint64_t target) {
+    Timeline* timeline = machine->timeline;
+    for (;;) {
+        uint64_t icount = machine->icount;
+        if (icount % timeline->interval == 0) timeline_snapshot(machine, memory);
+        if (icount >= target) return STOP_BUDGET;
+        uint64_t boundary = (icount / timeline->interval + 1) * timeline->interval;
+        Stop_Reason reason = run(machine, memory, (target < boundary ? target : boundary) - icount);
+        if (machine->icount > timeline->horizon) timeline->horizon = machine->icount;
+        if (reason != STOP_BUDGET) return reason;
+    }
+}
+
+bool is_debug_stop(Stop_Reason reason) {
+    return reason == STOP_BREAKPOINT || reason == STOP_WATCHPOINT;
+}
+
+// back to `target` in the past: one snapshot restore, then less than
+// `interval` instructions run again
+void timeline_seek(Machine* machine, Memory memory, uint64_t target) {
+    Timeline* timeline = machine->timeline;
+    size_t low = 0;
+    size_t high = timeline->snapshot_count;
+    while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (timeline->snapshots[middle].cpu.icount <= target) low = middle;
+        else high = middle;
+    }
+    restore_snapshot(machine, memory, &timeline->snapshots[low]);
+    while (machine->icount < target) {
+        Stop_Reason reason = timeline_run(machine, memory, target);
+        if (reason != STOP_BUDGET && !is_debug_stop(reason) && reason != STOP_ILLEGAL_OPCODE) break;
+    }
+}
+
+// back to the last breakpoint or watchpoint stop before now, going through
+// the snapshots from the newest. false when there is none, the machine is
+// then where it was
+bool timeline_reverse_continue(Machine* machine, Memory memory) {
+    Timeline* timeline = machine->timeline;
+    uint64_t now = machine->icount;
+    for (size_t k = timeline->snapshot_count; k-- > 0;) {
+        uint64_t begin = timeline->snapshots[k].cpu.icount;
+        if (begin >= now) continue;
+        uint64_t end = k + 1 < timeline->snapshot_count ? timeline->snapshots[k + 1].cpu.icount : now;
+        if (end > now) end = now;
+        restore_snapshot(machine, memory, &timeline->snapshots[k]);
+        uint64_t found = UINT64_MAX;
+        while (machine->icount < end) {
+            Stop_Reason reason = timeline_run(machine, memory, end);
+            if (is_debug_stop(reason)) found = machine->icount;
+            else if (reason != STOP_BUDGET && reason != STOP_ILLEGAL_OPCODE) break;
+        }
+        if (found != UINT64_MAX) {
+            timeline_seek(machine, memory, found);
+            return true;
+        }
+    }
+    timeline_seek(machine, memory, now);
+    return false;
+}
+
+// the last store to `addr` before `before`, NULL when the log has none
+const Write_Record* last_write(const Timeline* timeline, uWord addr, uint64_t before) {
+    for (size_t i = timeline->write_count; i-- > 0;) {
+        const Write_Record* record = &timeline->writes[i];
+        if (record->icount < before && record->addr == addr) return record;
+    }
+    return NULL;
+}
+
+// x3000, 0x3000 or 12288
+bool parse_address(const char* text, uWord* addr) {
+    char* end;
+    long value = (text[0] == 'x' || text[0] == 'X') ? strtol(text + 1, &end, 16) : strtol(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || value < 0 || value >= MEMORY_SIZE) return false;
+    *addr = value;
+    return true;
+}
+
+// `r1 == 5`, `r0 < x10` or `r7 != -1`
+bool parse_condition(const char* reg, const char* op, const char* value, uWord addr, Condition* condition) {
+    if ((reg[0] != 'r' && reg[0] != 'R') || reg[1] < '0' || reg[1] > '7' || reg[2] != '\0') return false;
+    int found = -1;
+    for (int i = 0; i < COND_COUNT; i++) {
+        if (strcmp(op, condition_op_name[i]) == 0) found = i;
+    }
+    if (found < 0) return false;
+    char* end;
+    bool negative = value[0] == '-';
+    const char* digits = negative ? value + 1 : value;
+    long number = (digits[0] == 'x' || digits[0] == 'X') ? strtol(digits + 1, &end, 16) : strtol(digits, &end, 0);
+    if (*digits == '\0' || *end != '\0' || number < 0 || number >= MEMORY_SIZE) return false;
+    *condition = (Condition){
+        .addr = addr, .reg = reg[1] - '0', .op = found, .value = (Word)(negative ? -number : number),
+    };
+    return true;
+}
+
+void print_debug_stop(FILE* out, const Machine* machine, Stop_Reason reason) {
+    fprintf(out, "icount %llu, PC x%04X", (unsigned long long)machine->icount, machine->PC);
+    if (reason == STOP_WATCHPOINT) {
+        const Debugger* debugger = machine->debugger;
+        fprintf(out, " (%s: %s of x%04X)", stop_reason_name[reason], debugger->hit_kind == WATCH_READ ? "read" : "write",
+                debugger->hit_addr);
+    } else if (reason != STOP_BUDGET) {
+        fprintf(out, " (%s)", stop_reason_name[reason]);
+    }
+    fprintf(out, "\n");
+}
+
+void print_debug_points(FILE* out, const Machine* machine) {
+    const Debugger* debugger = machine->debugger;
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (is_breakpoint(machine, addr)) {
+            fprintf(out, "break x%04zX", addr);
+            const char* separator = " if ";
+            for (size_t i = 0; i < debugger->condition_count; i++) {
+                const Condition* condition = &debugger->conditions[i];
+                if (condition->addr != addr) continue;
+                fprintf(out, "%sr%d %s %d", separator, condition->reg, condition_op_name[condition->op], condition->value);
+                separator = " or ";
+            }
+            fprintf(out, "\n");
+        }
+        bool read = is_watched(debugger, addr, WATCH_READ);
+        bool write = is_watched(debugger, addr, WATCH_WRITE);
+        if (read || write) fprintf(out, "watch x%04zX %s\n", addr, read && write ? "rw" : read ? "r" : "w");
+    }
+}
+
+void print_debug_help(FILE* out) {
+    fprintf(out, "step [n]                          run n instructions (default 1)\n");
+    fprintf(out, "continue                          run to the next breakpoint, watchpoint or the end\n");
+    fprintf(out, "reverse-step [n]                  go back n instructions (default 1)\n");
+    fprintf(out, "reverse-continue                  go back to the last breakpoint or watchpoint hit\n");
+    fprintf(out, "break <addr> [if r<n> <op> <val>] set a breakpoint, conditions on the same addr are or'ed,\n");
+    fprintf(out, "                                  op is one of == != < <= > >=, delete <addr> removes it\n");
+    fprintf(out, "watch <addr> [r|w|rw]             stop in front of a load or store of addr (default w),\n");
+    fprintf(out, "                                  unwatch <addr> removes it\n");
+    fprintf(out, "info                              the breakpoints and watchpoints\n");
+    fprintf(out, "who <addr>                        the last store to addr and the instruction that made it\n");
+    fprintf(out, "regs                              the registers\n");
+    fprintf(out, "quit\n");
+}
+
+#define DEBUG_MAX_LINE 256
+
+// commands come a line at a time from `in`, everything the session says goes
+// to `out`. the guest console stays on stdout
+void debug_session(Machine* machine, Memory memory, FILE* in, FILE* out) {
+    timeline_snapshot(machine, memory);
+    char line[DEBUG_MAX_LINE];
+    fprintf(out, "(vboy) ");
+    fflush(out);
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char command[32] = {0};
+        char argument[64] = {0};
+        char word[8] = {0};
+        char reg[8] = {0};
+        char op[8] = {0};
+        char value[64] = {0};
+        int count = sscanf(line, "%31s %63s %7s %7s %7s %63s", command, argument, word, reg, op, value);
+        uint64_t n = count >= 2 ? strtoull(argument, NULL, 0) : 1;
+        uWord addr = 0;
+        bool has_addr = count >= 2 && parse_address(argument, &addr);
+        if (count <= 0) {
+            // nothing to do
+        } else if (strcmp(command, "step") == 0 || strcmp(command, "s") == 0) {
+            // the breakpoint under PC is where the user already is, a watchpoint still stops it
+            machine->resuming |= RESUME_BREAKPOINT;
+            Stop_Reason reason = timeline_run(machine, memory, machine->icount + n);
+            console_flush(machine->console);
+            print_debug_stop(out, machine, reason);
+        } else if (strcmp(command, "continue") == 0 || strcmp(command, "c") == 0) {
+            machine->resuming |= RESUME_BREAKPOINT;
+            Stop_Reason reason = timeline_run(machine, memory, RUN_FOREVER);
+            console_flush(machine->console);
+            print_debug_stop(out, machine, reason);
+        } else if (strcmp(command, "reverse-step") == 0 || strcmp(command, "rs") == 0) {
+            timeline_seek(machine, memory, n > machine->icount ? 0 : machine->icount - n);
+            print_debug_stop(out, machine, STOP_BUDGET);
+        } else if (strcmp(command, "reverse-continue") == 0 || strcmp(command, "rc") == 0) {
+            if (!timeline_reverse_continue(machine, memory)) fprintf(out, "no breakpoint or watchpoint was hit before this\n");
+            print_debug_stop(out, machine, STOP_BUDGET);
+        } else if ((strcmp(command, "break") == 0 || strcmp(command, "b") == 0) && has_addr && count == 2) {
+            clear_conditions(machine->debugger, addr);
+            set_breakpoint(machine, addr, true);
+        } else if ((strcmp(command, "break") == 0 || strcmp(command, "b") == 0) && has_addr && count == 6 && strcmp(word, "if") == 0) {
+            Condition condition;
+            if (!parse_condition(reg, op, value, addr, &condition)) {
+                fprintf(out, "[ERROR] expected a condition like `if r1 == 5`\n");
+            } else {
+                add_condition(machine->debugger, &condition);
+                set_breakpoint(machine, addr, true);
+            }
+        } else if ((strcmp(command, "delete") == 0 || strcmp(command, "d") == 0) && has_addr) {
+            clear_conditions(machine->debugger, addr);
+            set_breakpoint(machine, addr, false);
+        } else if ((strcmp(command, "watch") == 0 || strcmp(command, "w") == 0) && has_addr) {
+            uint8_t kind = WATCH_WRITE;
+            if (count >= 3 && strcmp(word, "r") == 0) kind = WATCH_READ;
+            else if (count >= 3 && strcmp(word, "rw") == 0) kind = WATCH_READ | WATCH_WRITE;
+            set_watchpoint(machine->debugger, addr, kind, true);
+        } else if (strcmp(command, "unwatch") == 0 && has_addr) {
+            set_watchpoint(machine->debugger, addr, WATCH_READ | WATCH_WRITE, false);
+        } else if (strcmp(command, "info") == 0 || strcmp(command, "i") == 0) {
+            print_debug_points(out, machine);
+        } else if (strcmp(command, "who") == 0 && has_addr) {
+            const Write_Record* record = last_write(machine->timeline, addr, machine->icount);
+            if (record == NULL) {
+                fprintf(out, "x%04X has not been stored to since the start\n", addr);
+            } else {
+                fprintf(out, "x%04X = x%04X, stored by the instruction at x%04X at icount %llu\n", addr, record->value,
+                        record->pc, (unsigned long long)record->icount);
+            }
+        } else if (strcmp(command, "regs") == 0 || strcmp(command, "r") == 0) {
+            fprint_machine_state(out, machine);
+            fprintf(out, "icount:%llu\n", (unsigned long long)machine->icount);
+        } else if (strcmp(command, "quit") == 0 || strcmp(command, "q") == 0) {
+            break;
+        } else {
+            print_debug_help(out);
+        }
+        fprintf(out, "(vboy) ");
+        fflush(out);
+    }
+}
+
+#ifdef HOST_IO_SUPPORTED
+// a port number listens on 127.0.0.1, anything else is the path of a unix
+// socket. -1 when it cant be made
+int listen_socket(const char* where) {
+    char* end;
+    long port = strtol(where, &end, 10);
+    int server = -1;
+    bool bound = false;
+    if (*where != '\0' && *end == '\0') {
+        if (port <= 0 || port > 65535) {
+            printf("[ERROR] `%s` is not a port\n", where);
+            return -1;
+        }
+        struct sockaddr_in address = {
+            .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        server = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        if (server >= 0) setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        bound = server >= 0 && bind(server, (struct sockaddr*)&address, sizeof(address)) == 0;
+    } else {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        if (strlen(where) >= sizeof(address.sun_path)) {
+            printf("[ERROR] socket path `%s` is too long\n", where);
+            return -1;
+        }
+        strcpy(address.sun_path, where);
+        // left over from an earlier run
+        struct stat info;
+        if (stat(where, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(where);
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        bound = server >= 0 && bind(server, (struct sockaddr*)&address, sizeof(address)) == 0;
+    }
+    if (!bound || listen(server, 1) != 0) {
+        printf("[ERROR] could not listen on `%s`\n", where);
+        if (server >= 0) close(server);
+        return -1;
+    }
+    // a debugger that goes away in the middle of a reply must not take the guest with it
+    signal(SIGPIPE, SIG_IGN);
+    return server;
+}
+
+// waits for one client on `where`, see `listen_socket`. the session then
+// reads its commands from it and answers on it
+bool accept_debug_client(const char* where, FILE** in, FILE** out) {
+    int server = listen_socket(where);
+    if (server < 0) return false;
+    printf("waiting for a debugger on `%s`\n", where);
+    fflush(stdout);
+    int client = accept(server, NULL, NULL);
+    close(server);
+    if (client < 0) {
+        printf("[ERROR] could not accept a debugger on `%s`\n", where);
+        return false;
+    }
+    *in = fdopen(client, "r");
+    *out = fdopen(dup(client), "w");
+    return true;
+}
+
+// a gdb remote serial protocol stub. it only talks to the debugger while the
+// machine is stopped: running, it looks for an interrupt or a debugger
+// attaching between slices of GDB_POLL_INSTRUCTIONS, so the engines never
+// see it and run at full speed attached or not. the registers are r0-r7, pc
+// and psr, 16 bits each. addresses are lc3 word addresses, with the two
+// bytes of a word little endian
+#define GDB_POLL_INSTRUCTIONS (1 << 20)
+#define GDB_MAX_PACKET 4096
+#define GDB_REGISTER_COUNT 10
+
+typedef struct {
+    int listener;
+    int client;   // -1 while detached
+    bool no_ack;  // QStartNoAckMode
+    char input[GDB_MAX_PACKET];
+    size_t input_count;
+    size_t input_pos;
+} Gdb_Stub;
+
+static const char gdb_target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><feature name=\"org.vboy.lc3\">"
+    "<reg name=\"r0\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r1\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r2\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r3\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r4\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r5\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r6\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r7\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"psr\" bitsize=\"16\" type=\"uint16\"/>"
+    "</feature></target>";
+
+int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// the next byte from the debugger, -1 when it went away
+int gdb_getc(Gdb_Stub* gdb) {
+    if (gdb->input_pos == gdb->input_count) {
+        ssize_t count = read(gdb->client, gdb->input, sizeof(gdb->input));
+        if (count <= 0) return -1;
+        gdb->input_count = count;
+        gdb->input_pos = 0;
+    }
+    return (uint8_t)gdb->input[gdb->input_pos++];
+}
+
+void gdb_write(Gdb_Stub* gdb, const char* bytes, size_t count) {
+    while (count > 0) {
+        ssize_t written = write(gdb->client, bytes, count);
+        if (written <= 0) return;
+        bytes += written;
+        count -= written;
+    }
+}
+
+void gdb_send(Gdb_Stub* gdb, const char* payload) {
+    char packet[GDB_MAX_PACKET + 4];
+    uint8_t sum = 0;
+    for (const char* c = payload; *c != '\0'; c++) sum += (uint8_t)*c;
+    int count = snprintf(packet, sizeof(packet), "$%s#%02x", payload, sum);
+    gdb_write(gdb, packet, count);
+}
+
+// the payload of the next packet, acked. an interrupt between packets comes
+// back as "\x03". false when the debugger went away
+bool gdb_receive(Gdb_Stub* gdb, char* payload) {
+    for (;;) {
+        int c = gdb_getc(gdb);
+        if (c < 0) return false;
+        if (c == 0x03) {
+            strcpy(payload, "\x03");
+            return true;
+        }
+        if (c != '$') continue; // acks
+        size_t length = 0;
+        uint8_t sum = 0;
+        while ((c = gdb_getc(gdb)) >= 0 && c != '#') {
+            if (length + 1 < GDB_MAX_PACKET) payload[length++] = c;
+            sum += c;
+        }
+        int high = gdb_getc(gdb);
+        int low = gdb_getc(gdb);
+        if (low < 0) return false;
+        payload[length] = '\0';
+        bool good = hex_value(high) * 16 + hex_value(low) == sum;
+        if (!gdb->no_ack) gdb_write(gdb, good ? "+" : "-", 1);
+        if (good) return true;
+    }
+}
+
+// looked at between slices while the guest runs, true when the debugger
+// wants it stopped or went away
+bool gdb_interrupted(Gdb_Stub* gdb) {
+    struct pollfd fd = { .fd = gdb->client, .events = POLLIN };
+    if (gdb->input_pos == gdb->input_count && poll(&fd, 1, 0) <= 0) return false;
+    int c = gdb_getc(gdb);
+    return c == 0x03 || c < 0;
+}
 
-        case Op_STI: {
-            op_sti(rest, machine, memory);
-        } break;
+bool gdb_accept(Gdb_Stub* gdb, bool wait) {
+    struct pollfd fd = { .fd = gdb->listener, .events = POLLIN };
+    if (!wait && poll(&fd, 1, 0) <= 0) return false;
+    gdb->client = accept(gdb->listener, NULL, NULL);
+    gdb->no_ack = false;
+    gdb->input_count = 0;
+    gdb->input_pos = 0;
+    return gdb->client >= 0;
+}
 
-        case Op_JMP: {
-            op_jmp(rest, machine);
-        } break;
+// the guest goes on without anything the debugger left behind
+void gdb_detach(Machine* machine, Gdb_Stub* gdb) {
+    close(gdb->client);
+    gdb->client = -1;
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (is_breakpoint(machine, addr)) set_breakpoint(machine, addr, false);
+    }
+    if (machine->debugger != NULL) free_debugger(machine->debugger);
+    machine->debugger = NULL;
+    machine->resuming = 0;
+}
 
-        case Op_RES: {
-            printf("[ERROR] Illegal Opcode\n");
-            return false;
-        } break;
+uWord gdb_register(const Machine* machine, int n) {
+    if (n < 8) return machine->registers[n];
+    if (n == 8) return machine->PC;
+    return read_psr(machine);
+}
 
-        case Op_LEA: {
-            op_lea(rest, machine);
-        } break;
+void gdb_set_register(Machine* machine, int n, uWord value) {
+    if (n < 8) {
+        machine->registers[n] = value;
+    } else if (n == 8) {
+        machine->PC = value;
+        machine->resuming = 0;
+    } else {
+        machine->PSR = value;
+        machine->cc_result = CC_IN_PSR;
+        machine->event = true; // the priority level may let an interrupt in
+    }
+}
 
-        case Op_TRAP: {
-            op_trap(rest, machine, memory);
-        } break;
+// 4 hex digits, low byte first
+bool gdb_parse_word(const char* text, uWord* value) {
+    int digits[4];
+    for (int i = 0; i < 4; i++) {
+        digits[i] = hex_value(text[i]);
+        if (digits[i] < 0) return false;
     }
+    *value = (digits[0] << 4 | digits[1]) | (digits[2] << 4 | digits[3]) << 8;
     return true;
 }
 
-void* update_device(void* arg) {
-    Memory* mem = (Memory*)arg;
-    return NULL;
+void gdb_format_word(char* text, uWord value) {
+    sprintf(text, "%02x%02x", value & 0xFF, value >> 8);
 }
 
-void handle_int(Machine* machine, Memory memory) {
-    memory[machine->SSP--] = machine->PC;
-    memory[machine->SSP--] = machine->PSR;
-    machine->PSR &= ~PSR_BIT_SSM;
-    machine->PC = memory[machine->intv];
+// runs `steps` instructions, RUN_FOREVER runs until a stop or an interrupt
+Stop_Reason gdb_resume(Machine* machine, Memory memory, Gdb_Stub* gdb, uint64_t steps, bool* interrupted) {
+    // continuing from a breakpoint runs the instruction under it
+    machine->resuming |= RESUME_BREAKPOINT;
+    *interrupted = false;
+    for (;;) {
+        Stop_Reason reason = run(machine, memory, steps < GDB_POLL_INSTRUCTIONS ? steps : GDB_POLL_INSTRUCTIONS);
+        console_sync(machine->console);
+        if (steps != RUN_FOREVER || reason != STOP_BUDGET) return reason;
+        if (gdb_interrupted(gdb)) {
+            *interrupted = true;
+            return reason;
+        }
+    }
 }
 
-void execute_program(Machine* machine, Memory memory) {
-    while (memory[MACHINE_CONTROL_REGISTER] != 0) {
-        if (machine->PC + 1 >= MEMORY_SIZE) {
-            printf("End of Memory Reached\n");
-            return;
-        }
-        if (machine->int_sig != 0) {
-            handle_int(machine, memory);
+void gdb_stop_reply(char* reply, const Machine* machine, Stop_Reason reason, bool interrupted) {
+    switch (reason) {
+        case STOP_HALTED: strcpy(reply, "W00"); break;
+        case STOP_ILLEGAL_OPCODE: strcpy(reply, "S04"); break; // SIGILL
+        case STOP_END_OF_MEMORY: strcpy(reply, "S0b"); break;  // SIGSEGV
+        case STOP_WATCHPOINT: {
+            const Debugger* debugger = machine->debugger;
+            bool both = is_watched(debugger, debugger->hit_addr, WATCH_READ) && is_watched(debugger, debugger->hit_addr, WATCH_WRITE);
+            char* kind = both ? "awatch" : debugger->hit_kind == WATCH_READ ? "rwatch" : "watch";
+            sprintf(reply, "T05%s:%x;", kind, debugger->hit_addr);
+        } break;
+        default: strcpy(reply, interrupted ? "S02" : "S05"); break; // SIGINT, SIGTRAP
+    }
+}
+
+// answers packets until the debugger detaches, true, or the program is
+// over, false
+bool gdb_serve(Machine* machine, Memory memory, Gdb_Stub* gdb) {
+    char packet[GDB_MAX_PACKET];
+    char reply[GDB_MAX_PACKET];
+    while (gdb_receive(gdb, packet)) {
+        reply[0] = '\0';
+        unsigned addr = 0;
+        unsigned length = 0;
+        switch (packet[0]) {
+            case 0x03:
+            case '?': {
+                strcpy(reply, "S05");
+            } break;
+            case 'g': {
+                for (int n = 0; n < GDB_REGISTER_COUNT; n++) gdb_format_word(reply + 4 * n, gdb_register(machine, n));
+            } break;
+            case 'G': {
+                uWord values[GDB_REGISTER_COUNT];
+                bool parsed = strlen(packet + 1) >= 4 * GDB_REGISTER_COUNT;
+                for (int n = 0; parsed && n < GDB_REGISTER_COUNT; n++) parsed = gdb_parse_word(packet + 1 + 4 * n, &values[n]);
+                if (!parsed) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                for (int n = 0; n < GDB_REGISTER_COUNT; n++) gdb_set_register(machine, n, values[n]);
+                strcpy(reply, "OK");
+            } break;
+            case 'p': {
+                unsigned n = strtoul(packet + 1, NULL, 16);
+                if (n < GDB_REGISTER_COUNT) gdb_format_word(reply, gdb_register(machine, n));
+                else strcpy(reply, "E01");
+            } break;
+            case 'P': {
+                char* value = strchr(packet, '=');
+                unsigned n = strtoul(packet + 1, NULL, 16);
+                uWord word;
+                if (value == NULL || n >= GDB_REGISTER_COUNT || !gdb_parse_word(value + 1, &word)) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                gdb_set_register(machine, n, word);
+                strcpy(reply, "OK");
+            } break;
+            case 'm': {
+                if (sscanf(packet + 1, "%x,%x", &addr, &length) != 2 || addr >= MEMORY_SIZE) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                if (length > (GDB_MAX_PACKET - 1) / 2) length = (GDB_MAX_PACKET - 1) / 2;
+                for (unsigned i = 0; i < length; i++) {
+                    uWord word = read_memory(memory, (uWord)(addr + i / 2));
+                    sprintf(reply + 2 * i, "%02x", i % 2 == 0 ? word & 0xFF : word >> 8);
+                }
+            } break;
+            case 'M': {
+                char* data = strchr(packet, ':');
+                if (data == NULL || sscanf(packet + 1, "%x,%x", &addr, &length) != 2 || addr >= MEMORY_SIZE ||
+                    strlen(data + 1) < 2 * length) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                data++;
+                for (unsigned i = 0; i < length; i += 2) {
+                    uWord target = addr + i / 2;
+                    uWord value = read_memory(memory, target);
+                    value = (value & 0xFF00) | (hex_value(data[2 * i]) << 4 | hex_value(data[2 * i + 1]));
+                    if (i + 1 < length) value = (value & 0x00FF) | (hex_value(data[2 * i + 2]) << 4 | hex_value(data[2 * i + 3])) << 8;
+                    write_memory(machine, memory, target, value);
+                }
+                strcpy(reply, "OK");
+            } break;
+            case 'c':
+            case 's': {
+                if (sscanf(packet + 1, "%x", &addr) == 1) gdb_set_register(machine, 8, addr);
+                bool interrupted;
+                Stop_Reason reason = gdb_resume(machine, memory, gdb, packet[0] == 's' ? 1 : RUN_FOREVER, &interrupted);
+                gdb_stop_reply(reply, machine, reason, interrupted);
+                if (reason == STOP_HALTED) {
+                    gdb_send(gdb, reply);
+                    return false;
+                }
+            } break;
+            case 'Z':
+            case 'z': {
+                unsigned type;
+                if (sscanf(packet + 1, "%x,%x", &type, &addr) != 2 || type > 4 || addr >= MEMORY_SIZE) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                bool insert = packet[0] == 'Z';
+                if (type <= 1) {
+                    // software and hardware breakpoints are the same thing here
+                    set_breakpoint(machine, addr, insert);
+                } else {
+                    if (machine->debugger == NULL) machine->debugger = calloc(1, sizeof(Debugger));
+                    uint8_t kind = type == 2 ? WATCH_WRITE : type == 3 ? WATCH_READ : WATCH_READ | WATCH_WRITE;
+                    set_watchpoint(machine->debugger, addr, kind, insert);
+                }
+                strcpy(reply, "OK");
+            } break;
+            case 'D': {
+                gdb_send(gdb, "OK");
+                gdb_detach(machine, gdb);
+                return true;
+            } break;
+            case 'k': {
+                gdb_detach(machine, gdb);
+                return false;
+            } break;
+            case 'H':
+            case 'T': {
+                strcpy(reply, "OK");
+            } break;
+            case 'Q': {
+                if (strcmp(packet, "QStartNoAckMode") == 0) {
+                    gdb_send(gdb, "OK");
+                    gdb->no_ack = true;
+                    continue;
+                }
+            } break;
+            case 'q': {
+                unsigned offset;
+                if (strncmp(packet, "qSupported", 10) == 0) {
+                    sprintf(reply, "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+", GDB_MAX_PACKET);
+                } else if (strcmp(packet, "qAttached") == 0) {
+                    strcpy(reply, "1");
+                } else if (strcmp(packet, "qC") == 0) {
+                    strcpy(reply, "QC1");
+                } else if (strcmp(packet, "qfThreadInfo") == 0) {
+                    strcpy(reply, "m1");
+                } else if (strcmp(packet, "qsThreadInfo") == 0) {
+                    strcpy(reply, "l");
+                } else if (sscanf(packet, "qXfer:features:read:target.xml:%x,%x", &offset, &length) == 2) {
+                    size_t size = sizeof(gdb_target_xml) - 1;
+                    if (offset > size) offset = size;
+                    if (length > GDB_MAX_PACKET - 2) length = GDB_MAX_PACKET - 2;
+                    bool last = offset + length >= size;
+                    size_t count = last ? size - offset : length;
+                    reply[0] = last ? 'l' : 'm';
+                    memcpy(reply + 1, gdb_target_xml + offset, count);
+                    reply[count + 1] = '\0';
+                }
+            } break;
         }
-        uWord inst = memory[machine->PC++];
-        bool res = execute_instruction(machine, inst, memory);
-        if (!res) printf("ERROR: Instruction no %u\n", machine->PC);
+        gdb_send(gdb, reply);
+    }
+    gdb_detach(machine, gdb);
+    return true;
+}
+
+// runs the program like `execute_program`, a debugger can attach to it at
+// the end of every slice. with `wait` it waits for one before the first
+// instruction. false when it cant listen
+bool gdb_execute_program(Machine* machine, Memory memory, const char* where, bool wait) {
+    Gdb_Stub gdb = { .client = -1 };
+    gdb.listener = listen_socket(where);
+    if (gdb.listener < 0) return false;
+    bool running = true;
+    if (wait) {
+        printf("waiting for a debugger on `%s`\n", where);
+        fflush(stdout);
+        if (gdb_accept(&gdb, true)) running = gdb_serve(machine, memory, &gdb);
+    }
+    while (running) {
+        Stop_Reason reason = run(machine, memory, GDB_POLL_INSTRUCTIONS);
+        console_sync(machine->console);
+        if (!report_stop(machine, reason)) break;
+        if (gdb_accept(&gdb, false)) running = gdb_serve(machine, memory, &gdb);
     }
+    if (gdb.client >= 0) close(gdb.client);
+    close(gdb.listener);
+    return true;
+}
+#else
+bool accept_debug_client(const char* where, FILE** in, FILE** out) {
+    (void)in;
+    (void)out;
+    printf("[ERROR] cant listen on `%s`, debugging over a socket is not supported on this platform\n", where);
+    return false;
+}
+
+bool gdb_execute_program(Machine* machine, Memory memory, const char* where, bool wait) {
+    (void)machine;
+    (void)memory;
+    (void)wait;
+    printf("[ERROR] cant listen on `%s`, debugging over a socket is not supported on this platform\n", where);
+    return false;
 }
+#endif // HOST_IO_SUPPORTED
+#endif // _DEBUGGER
 
 void print_byte_data(const Byte_Data byte_data) {
     for (int i = 0; i < byte_data.count; i++) {
@@ -509,7 +4422,23 @@ bool map_byte_data(Memory memory, const Byte_Data* byte_data, size_t loc) {
         printf("[ERROR] mapped data is too large for memory\n");
         return false;
     }
-    memcpy(memory + loc, byte_data->bytes, byte_data->count);
+    // bytes go in as little endian words, a page worth at a time
+    size_t words = byte_data->count / sizeof(uWord);
+    for (size_t i = 0; i < words;) {
+        size_t addr = loc + i;
+        size_t count = PAGE_WORDS - (addr & PAGE_MASK);
+        if (count > words - i) count = words - i;
+        uWord* page = writable_page(memory, addr >> PAGE_BITS);
+        memcpy(&page[addr & PAGE_MASK], byte_data->bytes + i * sizeof(uWord), count * sizeof(uWord));
+        i += count;
+    }
+    // an odd last byte only replaces the low half
+    if (byte_data->count % sizeof(uWord) != 0) {
+        uWord addr = loc + words;
+        uWord word = read_memory(memory, addr);
+        memcpy(&word, byte_data->bytes + words * sizeof(uWord), 1);
+        poke_memory(memory, addr, word);
+    }
     return true;
 }
 
@@ -545,7 +4474,8 @@ Byte_Data read_bin_from_file(char* file_name) {
     Byte_Data byte_data = init_byte_data_size(length);
     byte_data.count = length;
     int ok = fread(byte_data.bytes, 1, length, fh);
-    if (!ok) {
+    fclose(fh);
+    if (!ok && length != 0) {
         printf("[ERROR] error reading binary data for file `%s`\n", file_name);
         exit(1);
     }
@@ -553,6 +4483,54 @@ Byte_Data read_bin_from_file(char* file_name) {
     return byte_data;
 }
 
+bool file_exists(char* file_name) {
+    FILE* file = fopen(file_name, "rb");
+    if (file == NULL) return false;
+    fclose(file);
+    return true;
+}
+
+// a file that gets mapped in read only instead of read, for files that cant
+// be mapped (pipes, empty files) it falls back to `read_bin_from_file`.
+// `stock` is the built in os, unless there is a file by that name. the bytes
+// must not be pushed to, `free_image` gives them back
+Byte_Data load_image(char* file_name) {
+    if (strcmp(file_name, "stock") == 0 && !file_exists(file_name)) {
+        return (Byte_Data){ .bytes = stock_os, .capacity = stock_os_len, .count = stock_os_len };
+    }
+#ifdef HOST_IO_SUPPORTED
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        printf("[ERROR] could not open specified file `%s`\n", file_name);
+        exit(1);
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes != MAP_FAILED) {
+            close(fd);
+            return (Byte_Data){ .bytes = bytes, .capacity = info.st_size, .count = info.st_size, .mapped = true };
+        }
+    }
+    close(fd);
+#endif
+    return read_bin_from_file(file_name);
+}
+
+// booting copies the images into guest memory, after that they can go
+void free_image(Byte_Data* image) {
+    if (image->bytes == stock_os) {
+        // built in
+#ifdef HOST_IO_SUPPORTED
+    } else if (image->mapped) {
+        munmap(image->bytes, image->capacity);
+#endif
+    } else {
+        free(image->bytes);
+    }
+    *image = (Byte_Data){0};
+}
+
 bool write_bin_to_file(const Byte_Data* byte_data, char* file_name) {
     FILE* file;
     file = fopen(file_name, "wb");
@@ -564,29 +4542,836 @@ bool write_bin_to_file(const Byte_Data* byte_data, char* file_name) {
     return true;
 }
 
+// lays fresh memory out the way a plain run does: MCR on, the os at 0x0000
+// and the program at 0x3000
+bool boot_memory(Memory memory, const Byte_Data* os, const Byte_Data* program) {
+    poke_memory(memory, MACHINE_CONTROL_REGISTER, 1);   // init MCR
+    if (os != NULL && !map_byte_data(memory, os, MEM_BEGIN)) return false;
+    if (program != NULL && !map_byte_data(memory, program, MEM_USERSPC_BEGIN)) return false;
+    return true;
+}
+
+// with an os PC starts on its entry point
+bool boot_machine(Machine* machine, Memory memory, const Byte_Data* os, const Byte_Data* program) {
+    if (os != NULL) machine->PC = MEM_OSSPC_BEGIN;
+    return boot_memory(memory, os, program);
+}
+
+// a program built as words instead of read from an image, loaded at
+// MEM_USERSPC_BEGIN with no os and PC on its first word
+void boot_words(Machine* machine, Memory memory, const uWord* words, size_t count) {
+    boot_memory(memory, NULL, NULL);
+    for (size_t i = 0; i < count; i++) poke_memory(memory, MEM_USERSPC_BEGIN + i, words[i]);
+    machine->PC = MEM_USERSPC_BEGIN;
+}
+
+// batch mode: runs every job of a manifest, each job being an os, a program
+// and a file to feed to TRAP_GETC, on a pool of threads. every job gets its
+// own Machine and Memory and its TRAP_OUT output captured, the results are
+// written out in manifest order once all of them are done
+//
+// manifest lines are `<os.bin> <program.bin> [stdin file]`, `-` for none,
+// blank lines and lines starting with `#` are skipped
+
+#define BATCH_MAX_LINE 4096
+
+typedef struct {
+    char* path;
+    Byte_Data data;
+} Batch_Image;
+
+// every job with the same os and program forks the same booted memory
+typedef struct {
+    const Byte_Data* os;
+    const Byte_Data* program;
+    Memory memory;
+    bool ok;
+} Batch_Template;
+
+typedef struct {
+    char* os_path;
+    char* program_path;
+    char* input_path;
+    const Byte_Data* os;
+    const Byte_Data* program;
+    const Byte_Data* input;
+    const Batch_Template* template;
+
+    bool failed;  // the images did not fit in memory
+    Console console; // never flushed, holds all the output
+    Stop_Reason reason;
+    uint64_t icount;
+    Word registers[8];
+    uWord PC;
+    uWord PSR;
+    Page_Usage pages;
+} Batch_Job;
+
+// the jobs a worker still owns, as a [begin, end) range packed in one word
+// so the owner can take from the front and thieves can take the back half
+// with a single compare and swap
+typedef struct {
+    _Alignas(64) _Atomic uint64_t range;
+} Batch_Queue;
+
+typedef struct {
+    Batch_Job* jobs;
+    size_t job_count;
+    Batch_Image* images;
+    size_t image_count;
+    Batch_Template* templates;
+    size_t template_count;
+    // the queues hand out groups of jobs, `group_jobs[group_begin[i]]` up to
+    // `group_jobs[group_begin[i + 1]]`. one job each, unless `lockstep`
+    size_t* group_jobs;
+    size_t* group_begin;
+    size_t group_count;
+    Batch_Queue* queues;
+    int worker_count;
+    Engine engine;
+    bool hle;
+    bool lockstep;
+    uint64_t limit;
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    int id;
+} Batch_Worker;
+
+int cpu_count() {
+#ifdef _SC_NPROCESSORS_ONLN
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0) return (int)count;
+#endif
+    return 1;
+}
+
+// every file is read once, however many jobs use it
+const Byte_Data* batch_load_image(Batch* batch, char* path) {
+    if (strcmp(path, "-") == 0) return NULL;
+    for (size_t i = 0; i < batch->image_count; i++) {
+        if (strcmp(batch->images[i].path, path) == 0) return &batch->images[i].data;
+    }
+    return NULL;
+}
+
+void batch_add_image(Batch* batch, size_t* capacity, char* path) {
+    if (strcmp(path, "-") == 0 || batch_load_image(batch, path) != NULL) return;
+    if (batch->image_count >= *capacity) {
+        *capacity = (*capacity + 1) * 2;
+        batch->images = realloc(batch->images, sizeof(*batch->images) * *capacity);
+    }
+    Batch_Image* image = &batch->images[batch->image_count++];
+    image->path = path;
+    image->data = load_image(path);
+}
+
+Batch_Template* batch_find_template(Batch* batch, const Batch_Job* job) {
+    for (size_t i = 0; i < batch->template_count; i++) {
+        Batch_Template* template = &batch->templates[i];
+        if (template->os == job->os && template->program == job->program) return template;
+    }
+    return NULL;
+}
+
+bool read_manifest(Batch* batch, char* file_name) {
+    FILE* file = fopen(file_name, "r");
+    if (file == NULL) {
+        printf("[ERROR] could not open specified file `%s`\n", file_name);
+        return false;
+    }
+
+    size_t job_capacity = 0;
+    size_t image_capacity = 0;
+    char line[BATCH_MAX_LINE];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char* fields[4] = {0};
+        int field_count = 0;
+        for (char* field = strtok(line, " \t\r\n"); field != NULL; field = strtok(NULL, " \t\r\n")) {
+            if (field_count == 0 && field[0] == '#') break;
+            if (field_count < 4) fields[field_count] = field;
+            field_count++;
+        }
+        if (field_count == 0) continue;
+        if (field_count < 2 || field_count > 3) {
+            printf("[ERROR] %s:%d: expected `<os.bin> <program.bin> [stdin file]`\n", file_name, line_number);
+            fclose(file);
+            return false;
+        }
+
+        if (batch->job_count >= job_capacity) {
+            job_capacity = (job_capacity + 1) * 2;
+            batch->jobs = realloc(batch->jobs, sizeof(*batch->jobs) * job_capacity);
+        }
+        Batch_Job* job = &batch->jobs[batch->job_count++];
+        *job = (Batch_Job){0};
+        job->os_path      = strdup(fields[0]);
+        job->program_path = strdup(fields[1]);
+        job->input_path   = strdup(field_count > 2 ? fields[2] : "-");
+    }
+    fclose(file);
+
+    // the paths are loaded up front, the workers only ever read them
+    for (size_t i = 0; i < batch->job_count; i++) {
+        Batch_Job* job = &batch->jobs[i];
+        batch_add_image(batch, &image_capacity, job->os_path);
+        batch_add_image(batch, &image_capacity, job->program_path);
+        batch_add_image(batch, &image_capacity, job->input_path);
+    }
+    for (size_t i = 0; i < batch->job_count; i++) {
+        Batch_Job* job = &batch->jobs[i];
+        job->os      = batch_load_image(batch, job->os_path);
+        job->program = batch_load_image(batch, job->program_path);
+        job->input   = batch_load_image(batch, job->input_path);
+    }
+
+    // one booted memory per distinct os and program. the workers fork it
+    // concurrently, so it gives up write access to its pages up front
+    size_t template_capacity = 0;
+    for (size_t i = 0; i < batch->job_count; i++) {
+        Batch_Job* job = &batch->jobs[i];
+        if (batch_find_template(batch, job) != NULL) continue;
+        if (batch->template_count >= template_capacity) {
+            template_capacity = (template_capacity + 1) * 2;
+            batch->templates = realloc(batch->templates, sizeof(*batch->templates) * template_capacity);
+        }
+        Batch_Template* template = &batch->templates[batch->template_count++];
+        template->os = job->os;
+        template->program = job->program;
+        template->memory = init_sparse_memory();
+        template->ok = boot_memory(template->memory, job->os, job->program);
+        memset(template->memory->writable, 0, sizeof(template->memory->writable));
+    }
+    for (size_t i = 0; i < batch->job_count; i++) {
+        batch->jobs[i].template = batch_find_template(batch, &batch->jobs[i]);
+    }
+    // the templates have their own copy of every os and program, only the
+    // input files are read from here on
+    for (size_t i = 0; i < batch->image_count; i++) {
+        bool input = false;
+        for (size_t j = 0; j < batch->job_count && !input; j++) input = batch->jobs[j].input == &batch->images[i].data;
+        if (!input) free_image(&batch->images[i].data);
+    }
+    return true;
+}
+
+void push_string(Byte_Data* byte_data, const char* string) {
+    for (; *string != '\0'; string++) push_data(byte_data, (uint8_t)*string);
+}
+
+void batch_start_job(Batch* batch, Batch_Job* job, Machine* machine, Memory* memory) {
+    static const Byte_Data no_input = {0};
+
+    *machine = init_machine();
+    machine->engine = batch->engine;
+    machine->hle = batch->hle;
+    *memory = fork_memory(job->template->memory);
+    if (job->os != NULL) machine->PC = MEM_OSSPC_BEGIN;
+    job->console = init_console(NULL);
+    machine->console = &job->console;
+    attach_standard_devices(machine);
+    machine->input = job->input != NULL ? job->input : &no_input;
+    if (!job->template->ok) job->failed = true;
+}
+
+// what a job makes of a stop with `left` instructions to go, the messages
+// go to the job output. false when the job is over
+bool batch_job_continues(Batch_Job* job, const Machine* machine, Stop_Reason reason, uint64_t left) {
+    if (reason == STOP_ILLEGAL_OPCODE) {
+        char message[64];
+        snprintf(message, sizeof(message), "[ERROR] Illegal Opcode\nERROR: Instruction no %u\n", machine->PC);
+        push_string(&job->console.buffer, message);
+        if (left > 0) return true;
+        reason = STOP_BUDGET;
+    }
+    if (reason == STOP_END_OF_MEMORY) push_string(&job->console.buffer, "End of Memory Reached\n");
+    if (reason == STOP_IDLE) push_string(&job->console.buffer, "Idle Loop Reached\n");
+    job->reason = reason;
+    return false;
+}
+
+void batch_finish_job(Batch_Job* job, Machine* machine, Memory memory) {
+    memcpy(job->registers, machine->registers, sizeof(job->registers));
+    job->PC = machine->PC;
+    job->PSR = read_psr(machine);
+    job->icount = machine->icount;
+    job->pages = page_usage(memory);
+    free_machine(machine);
+    free_memory(memory);
+}
+
+// same loop as `execute_program`
+void batch_run_job(Batch* batch, Batch_Job* job) {
+    Machine machine;
+    Memory memory;
+    batch_start_job(batch, job, &machine, &memory);
+    if (!job->failed) {
+        uint64_t left = batch->limit;
+        for (;;) {
+            uint64_t before = machine.icount;
+            Stop_Reason reason = run(&machine, memory, left);
+            if (left != RUN_FOREVER) left -= machine.icount - before;
+            if (!batch_job_continues(job, &machine, reason, left)) break;
+        }
+    }
+    batch_finish_job(job, &machine, memory);
+}
+
+// lockstep batch mode. jobs with the same os and program start out running
+// the same code, so `-lockstep` packs up to LOCKSTEP_LANES of them into one
+// group and keeps their registers, PC and flags in struct of arrays form, a
+// 16 bit lane per job. every step runs the instruction at the lowest PC once
+// for all the lanes sitting on it, lanes that branched elsewhere are left
+// behind until the lowest PC gets back to them, which is where loops and
+// if/else join up again.
+//
+// the steps cover the ALU ops, LEA, BR, JSR/JSRR/JMP and the loads and stores
+// below the io page, the loads and stores go through each lane's own memory
+// one lane at a time. anything else (TRAP, RTI, io, illegal opcodes, a lane
+// at an event or at its limit) is one `run` of that lane on its own machine,
+// so a group ends up exactly where running its jobs one by one would
+
+#define LOCKSTEP_LANES 16 // one AVX2 register of 16 bit words
+
+typedef uint32_t Lane_Mask; // a bit per lane
+
+typedef struct {
+    _Alignas(32) uWord R[8][LOCKSTEP_LANES];
+    _Alignas(32) uWord PC[LOCKSTEP_LANES];
+    _Alignas(32) uWord flags[LOCKSTEP_LANES]; // nzp, in PSR bit order
+    uint64_t icount[LOCKSTEP_LANES];
+    uint64_t until[LOCKSTEP_LANES]; // icount the lane can take lockstep steps up to
+    Machine machines[LOCKSTEP_LANES];
+    Memory memories[LOCKSTEP_LANES];
+    Batch_Job* jobs[LOCKSTEP_LANES];
+    Lane_Mask running;
+    Lane_Mask ready; // still short of `until`
+} Lanes;
+
+// the lane state lives in the arrays while it steps in lockstep, its machine
+// only gets it back around a `run`
+void lane_store(Lanes* lanes, int lane) {
+    Machine* machine = &lanes->machines[lane];
+    for (int r = 0; r < 8; r++) machine->registers[r] = (Word)lanes->R[r][lane];
+    machine->PC = lanes->PC[lane];
+    machine->PSR = (machine->PSR & ~PSR_NZP_MASK) | lanes->flags[lane];
+    machine->cc_result = CC_IN_PSR;
+    machine->icount = lanes->icount[lane];
+}
+
+void lane_load(Lanes* lanes, int lane, uint64_t limit) {
+    Machine* machine = &lanes->machines[lane];
+    for (int r = 0; r < 8; r++) lanes->R[r][lane] = (uWord)machine->registers[r];
+    lanes->PC[lane] = machine->PC;
+    lanes->flags[lane] = read_flags(machine);
+    lanes->icount[lane] = machine->icount;
+    // `run` would look at events again at the next deadline, and right away
+    // with anything pending
+    uint64_t until = machine->next_event < limit ? machine->next_event : limit;
+    if (machine->event || machine->int_pending != 0 || machine->rescheduled != 0) until = 0;
+    lanes->until[lane] = until;
+    if (machine->icount < until) lanes->ready |= (Lane_Mask)1 << lane;
+    else                         lanes->ready &= ~((Lane_Mask)1 << lane);
+}
+
+void lane_run(Batch* batch, Lanes* lanes, int lane) {
+    Machine* machine = &lanes->machines[lane];
+    Memory memory = lanes->memories[lane];
+    lane_store(lanes, lane);
+    uint64_t left = batch->limit == RUN_FOREVER ? RUN_FOREVER : batch->limit - machine->icount;
+    if (left == 0) {
+        // lockstep steps took it all the way to the limit
+        batch_job_continues(lanes->jobs[lane], machine, STOP_BUDGET, 0);
+        lanes->running &= ~((Lane_Mask)1 << lane);
+        return;
+    }
+    // a spin can take the rest of the budget up to the next event in one go
+    uint64_t budget = decode_at(machine, memory, machine->PC).kind == DEC_SPIN ? left : 1;
+    uint64_t before = machine->icount;
+    Stop_Reason reason = run(machine, memory, budget);
+    if (left != RUN_FOREVER) left -= machine->icount - before;
+    lane_load(lanes, lane, batch->limit);
+    if (reason == STOP_BUDGET && left > 0) return;
+    if (!batch_job_continues(lanes->jobs[lane], machine, reason, left)) lanes->running &= ~((Lane_Mask)1 << lane);
+}
+
+#ifdef __AVX2__
+__m256i lane_vector(Lane_Mask mask) {
+    const __m256i bits = _mm256_setr_epi16(1 << 0, 1 << 1, 1 << 2,  1 << 3,  1 << 4,  1 << 5,  1 << 6,  1 << 7,
+                                           1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, (short)(1 << 15));
+    return _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16((short)mask), bits), bits);
+}
+
+Lane_Mask lane_bits(__m256i vector) {
+    __m128i bytes = _mm_packs_epi16(_mm256_castsi256_si128(vector), _mm256_extracti128_si256(vector, 1));
+    return (Lane_Mask)_mm_movemask_epi8(bytes);
+}
+
+__m256i lane_flags(__m256i result) {
+    __m256i zero = _mm256_cmpeq_epi16(result, _mm256_setzero_si256());
+    __m256i negative = _mm256_cmpgt_epi16(_mm256_setzero_si256(), result);
+    __m256i flags = _mm256_or_si256(_mm256_and_si256(zero, _mm256_set1_epi16(0b010)),
+                                    _mm256_and_si256(negative, _mm256_set1_epi16(0b100)));
+    return _mm256_or_si256(flags, _mm256_andnot_si256(_mm256_or_si256(zero, negative), _mm256_set1_epi16(0b001)));
+}
+
+void lane_set(uWord* lanes, __m256i value, __m256i mask) {
+    __m256i old = _mm256_load_si256((const __m256i*)lanes);
+    _mm256_store_si256((__m256i*)lanes, _mm256_blendv_epi8(old, value, mask));
+}
+#endif
+
+// the lowest PC of the lanes in `mask`, `on` gets the lanes sitting on it
+uWord lane_lowest(const Lanes* lanes, Lane_Mask mask, Lane_Mask* on) {
+#ifdef __AVX2__
+    __m256i pcs = _mm256_load_si256((const __m256i*)lanes->PC);
+    __m256i masked = _mm256_blendv_epi8(_mm256_set1_epi16(-1), pcs, lane_vector(mask));
+    __m128i half = _mm_min_epu16(_mm256_castsi256_si128(masked), _mm256_extracti128_si256(masked, 1));
+    uWord pc = (uWord)_mm_cvtsi128_si32(_mm_minpos_epu16(half));
+    *on = lane_bits(_mm256_cmpeq_epi16(pcs, _mm256_set1_epi16((short)pc))) & mask;
+    return pc;
+#else
+    uWord pc = 0xFFFF;
+    for (Lane_Mask m = mask; m != 0; m &= m - 1) {
+        int lane = __builtin_ctz(m);
+        if (lanes->PC[lane] < pc) pc = lanes->PC[lane];
+    }
+    *on = 0;
+    for (Lane_Mask m = mask; m != 0; m &= m - 1) {
+        int lane = __builtin_ctz(m);
+        if (lanes->PC[lane] == pc) *on |= (Lane_Mask)1 << lane;
+    }
+    return pc;
+#endif
+}
+
+// ADD, AND and NOT on every lane in `mask`
+void lane_alu(Lanes* lanes, Lane_Mask mask, Decoded d) {
+#ifdef __AVX2__
+    __m256i a = _mm256_load_si256((const __m256i*)lanes->R[d.r1]);
+    __m256i b = d.kind == DEC_ADD_REG || d.kind == DEC_AND_REG
+              ? _mm256_load_si256((const __m256i*)lanes->R[d.r2]) : _mm256_set1_epi16(d.imm);
+    __m256i result;
+    switch (d.kind) {
+        case DEC_ADD_REG:
+        case DEC_ADD_IMM: result = _mm256_add_epi16(a, b); break;
+        case DEC_AND_REG:
+        case DEC_AND_IMM: result = _mm256_and_si256(a, b); break;
+        default:          result = _mm256_xor_si256(a, _mm256_set1_epi16(-1)); break;
+    }
+    __m256i select = lane_vector(mask);
+    lane_set(lanes->R[d.r0], result, select);
+    lane_set(lanes->flags, lane_flags(result), select);
+#else
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (!(mask >> lane & 1)) continue;
+        uWord a = lanes->R[d.r1][lane];
+        uWord b = d.kind == DEC_ADD_REG || d.kind == DEC_AND_REG ? lanes->R[d.r2][lane] : (uWord)d.imm;
+        uWord result;
+        switch (d.kind) {
+            case DEC_ADD_REG:
+            case DEC_ADD_IMM: result = a + b; break;
+            case DEC_AND_REG:
+            case DEC_AND_IMM: result = a & b; break;
+            default:          result = ~a; break;
+        }
+        lanes->R[d.r0][lane] = result;
+        lanes->flags[lane] = flags_from_result((Word)result);
+    }
+#endif
+}
+
+// BR on every lane in `mask`, they all sit on `pc`
+void lane_branch(Lanes* lanes, Lane_Mask mask, uWord pc, Decoded d) {
+    uWord next = pc + 1;
+    uWord target = next + d.imm;
+#ifdef __AVX2__
+    __m256i flags = _mm256_load_si256((const __m256i*)lanes->flags);
+    __m256i not_taken = _mm256_cmpeq_epi16(_mm256_and_si256(flags, _mm256_set1_epi16(d.r2)), _mm256_setzero_si256());
+    __m256i to = _mm256_blendv_epi8(_mm256_set1_epi16((short)target), _mm256_set1_epi16((short)next), not_taken);
+    lane_set(lanes->PC, to, lane_vector(mask));
+#else
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (!(mask >> lane & 1)) continue;
+        lanes->PC[lane] = (lanes->flags[lane] & d.r2) != 0 ? target : next;
+    }
+#endif
+}
+
+bool lane_memory(uWord addr) {
+    return addr < MEM_IOREG_BEGIN;
+}
+
+// runs the instruction `d` at `pc` on the lanes in `mask`, returns the lanes
+// it could not run, they need a `run` of their own
+Lane_Mask lane_step(Lanes* lanes, Lane_Mask mask, uWord pc, Decoded d) {
+    uWord next = pc + 1;
+    Lane_Mask left_out = 0;
+    switch (d.kind) {
+        case DEC_ADD_REG:
+        case DEC_ADD_IMM:
+        case DEC_AND_REG:
+        case DEC_AND_IMM:
+        case DEC_NOT: {
+            lane_alu(lanes, mask, d);
+        } break;
+        case DEC_BR: {
+            lane_branch(lanes, mask, pc, d);
+        } break;
+        case DEC_LEA: {
+            uWord addr = next + d.imm;
+            for (Lane_Mask m = mask; m != 0; m &= m - 1) {
+                int lane = __builtin_ctz(m);
+                lanes->R[d.r0][lane] = addr;
+                lanes->flags[lane] = flags_from_result((Word)addr);
+            }
+        } break;
+        case DEC_JMP: {
+            for (Lane_Mask m = mask; m != 0; m &= m - 1) {
+                int lane = __builtin_ctz(m);
+                lanes->PC[lane] = lanes->R[d.r1][lane];
+            }
+        } break;
+        case DEC_JSR:
+        case DEC_JSRR: {
+            for (Lane_Mask m = mask; m != 0; m &= m - 1) {
+                int lane = __builtin_ctz(m);
+                lanes->R[7][lane] = next;
+                lanes->PC[lane] = d.kind == DEC_JSR ? next + d.imm : lanes->R[d.r1][lane];
+            }
+        } break;
+        case DEC_LD:
+        case DEC_LDR:
+        case DEC_LDI: {
+            for (Lane_Mask m = mask; m != 0; m &= m - 1) {
+                int lane = __builtin_ctz(m);
+                Memory memory = lanes->memories[lane];
+                uWord addr = d.kind == DEC_LDR ? lanes->R[d.r1][lane] + (uWord)d.imm : next + d.imm;
+                if (d.kind == DEC_LDI && lane_memory(addr)) addr = read_memory(memory, addr);
+                if (!lane_memory(addr)) {
+                    left_out |= (Lane_Mask)1 << lane;
+                    continue;
+                }
+                uWord value = read_memory(memory, addr);
+                lanes->R[d.r0][lane] = value;
+                lanes->flags[lane] = flags_from_result((Word)value);
+            }
+        } break;
+        case DEC_ST:
+        case DEC_STR:
+        case DEC_STI: {
+            for (Lane_Mask m = mask; m != 0; m &= m - 1) {
+                int lane = __builtin_ctz(m);
+                Memory memory = lanes->memories[lane];
+                uWord addr = d.kind == DEC_STR ? lanes->R[d.r1][lane] + (uWord)d.imm : next + d.imm;
+                if (d.kind == DEC_STI && lane_memory(addr)) addr = read_memory(memory, addr);
+                if (!lane_memory(addr)) {
+                    left_out |= (Lane_Mask)1 << lane;
+                    continue;
+                }
+                write_memory(&lanes->machines[lane], memory, addr, lanes->R[d.r0][lane]);
+            }
+        } break;
+        default: return mask;
+    }
+
+    Lane_Mask stepped = mask & ~left_out;
+    bool jumps = d.kind == DEC_BR || d.kind == DEC_JMP || d.kind == DEC_JSR || d.kind == DEC_JSRR;
+#ifdef __AVX2__
+    if (!jumps) lane_set(lanes->PC, _mm256_set1_epi16((short)next), lane_vector(stepped));
+#endif
+    for (Lane_Mask m = stepped; m != 0; m &= m - 1) {
+        int lane = __builtin_ctz(m);
+#ifndef __AVX2__
+        if (!jumps) lanes->PC[lane] = next;
+#endif
+        if (++lanes->icount[lane] == lanes->until[lane]) lanes->ready &= ~((Lane_Mask)1 << lane);
+    }
+    return left_out;
+}
+
+void batch_run_lanes(Batch* batch, Batch_Job** jobs, int count) {
+    Lanes* lanes = aligned_alloc(_Alignof(Lanes), sizeof(Lanes));
+    memset(lanes, 0, sizeof(*lanes));
+    for (int lane = 0; lane < count; lane++) {
+        lanes->jobs[lane] = jobs[lane];
+        batch_start_job(batch, jobs[lane], &lanes->machines[lane], &lanes->memories[lane]);
+        lane_load(lanes, lane, batch->limit);
+        if (!jobs[lane]->failed) lanes->running |= (Lane_Mask)1 << lane;
+    }
+
+    while (lanes->running != 0) {
+        Lane_Mask on;
+        uWord pc = lane_lowest(lanes, lanes->running, &on);
+
+        // the lanes on `pc` that can step and see the same instruction there
+        // as the first of them, the other lanes on `pc` get a `run` instead
+        Lane_Mask step = pc + 1 < MEM_END ? on & lanes->ready : 0;
+        Lane_Mask alone = on & ~step;
+        if (step != 0) {
+            int first = __builtin_ctz(step);
+            const Page* page = lanes->memories[first]->pages[pc >> PAGE_BITS];
+            Instruction instruction = page->words[pc & PAGE_MASK];
+            for (Lane_Mask m = step & (step - 1); m != 0; m &= m - 1) {
+                int lane = __builtin_ctz(m);
+                if (lanes->memories[lane]->pages[pc >> PAGE_BITS] == page) continue;
+                if (read_memory(lanes->memories[lane], pc) == instruction) continue;
+                step &= ~((Lane_Mask)1 << lane);
+                alone |= (Lane_Mask)1 << lane;
+            }
+            alone |= lane_step(lanes, step, pc, decode_table[instruction]);
+        }
+        for (Lane_Mask m = alone; m != 0; m &= m - 1) lane_run(batch, lanes, __builtin_ctz(m));
+    }
+
+    for (int lane = 0; lane < count; lane++) {
+        if (!jobs[lane]->failed) lane_store(lanes, lane);
+        batch_finish_job(jobs[lane], &lanes->machines[lane], lanes->memories[lane]);
+    }
+    free(lanes);
+}
+
+uint64_t batch_range(uint32_t begin, uint32_t end) {
+    return (uint64_t)end << 32 | begin;
+}
+
+bool batch_pop(Batch_Queue* queue, size_t* job) {
+    uint64_t range = atomic_load(&queue->range);
+    for (;;) {
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (begin >= end) return false;
+        if (atomic_compare_exchange_weak(&queue->range, &range, batch_range(begin + 1, end))) {
+            *job = begin;
+            return true;
+        }
+    }
+}
+
+// takes the back half of some other worker's range, runs the first job of it
+// and keeps the rest. only ever called with the thief's own queue empty, and
+// nobody else can grow an empty queue, so that store needs no compare and swap
+bool batch_steal(Batch* batch, int thief, size_t* job) {
+    for (int i = 1; i < batch->worker_count; i++) {
+        Batch_Queue* victim = &batch->queues[(thief + i) % batch->worker_count];
+        uint64_t range = atomic_load(&victim->range);
+        for (;;) {
+            uint32_t begin = (uint32_t)range;
+            uint32_t end = (uint32_t)(range >> 32);
+            if (begin >= end) break;
+            uint32_t middle = begin + (end - begin) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &range, batch_range(begin, middle))) {
+                *job = middle;
+                atomic_store(&batch->queues[thief].range, batch_range(middle + 1, end));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+int batch_worker(void* arg) {
+    Batch_Worker* worker = arg;
+    Batch* batch = worker->batch;
+    size_t group;
+    while (batch_pop(&batch->queues[worker->id], &group) || batch_steal(batch, worker->id, &group)) {
+        size_t begin = batch->group_begin[group];
+        int count = (int)(batch->group_begin[group + 1] - begin);
+        if (!batch->lockstep) {
+            batch_run_job(batch, &batch->jobs[batch->group_jobs[begin]]);
+            continue;
+        }
+        Batch_Job* jobs[LOCKSTEP_LANES];
+        for (int i = 0; i < count; i++) jobs[i] = &batch->jobs[batch->group_jobs[begin + i]];
+        batch_run_lanes(batch, jobs, count);
+    }
+    return 0;
+}
+
+// one job per group, or with `lockstep` the jobs of every template in
+// manifest order, cut into groups of up to LOCKSTEP_LANES
+void batch_group_jobs(Batch* batch) {
+    batch->group_jobs = malloc(sizeof(*batch->group_jobs) * (batch->job_count + 1));
+    batch->group_begin = malloc(sizeof(*batch->group_begin) * (batch->job_count + 1));
+    size_t count = 0;
+    if (!batch->lockstep) {
+        for (; count < batch->job_count; count++) {
+            batch->group_jobs[count] = count;
+            batch->group_begin[batch->group_count++] = count;
+        }
+    }
+    for (size_t t = 0; batch->lockstep && t < batch->template_count; t++) {
+        int lanes = 0;
+        for (size_t i = 0; i < batch->job_count; i++) {
+            if (batch->jobs[i].template != &batch->templates[t]) continue;
+            if (lanes++ % LOCKSTEP_LANES == 0) batch->group_begin[batch->group_count++] = count;
+            batch->group_jobs[count++] = i;
+        }
+    }
+    batch->group_begin[batch->group_count] = count;
+}
+
+void write_escaped(FILE* file, const Byte_Data* byte_data) {
+    fputc('"', file);
+    for (size_t i = 0; i < byte_data->count; i++) {
+        uint8_t c = byte_data->bytes[i];
+        switch (c) {
+            case '\n': fputs("\\n", file); break;
+            case '\t': fputs("\\t", file); break;
+            case '\r': fputs("\\r", file); break;
+            case '"':  fputs("\\\"", file); break;
+            case '\\': fputs("\\\\", file); break;
+            default: {
+                if (c >= 0x20 && c < 0x7F) fputc(c, file);
+                else fprintf(file, "\\x%02x", c);
+            } break;
+        }
+    }
+    fputc('"', file);
+}
+
+// one line per job: `job=<n> os=<path> program=<path> stdin=<path>
+// stop=<reason> icount=<n> pc=<hex> psr=<n> r0=<n> .. r7=<n> resident_pages=<n>
+// private_pages=<n> output="<escaped>"`
+void write_results(const Batch* batch, FILE* file) {
+    for (size_t i = 0; i < batch->job_count; i++) {
+        const Batch_Job* job = &batch->jobs[i];
+        fprintf(file, "job=%zu os=%s program=%s stdin=%s ", i, job->os_path, job->program_path, job->input_path);
+        fprintf(file, "stop=%s ", job->failed ? "LOAD_FAILED" : stop_reason_name[job->reason]);
+        fprintf(file, "icount=%llu pc=0x%04x psr=%u", (unsigned long long)job->icount, job->PC, job->PSR);
+        for (int r = 0; r < 8; r++) fprintf(file, " r%d=%d", r, job->registers[r]);
+        fprintf(file, " resident_pages=%d private_pages=%d", job->pages.resident, job->pages.private);
+        fprintf(file, " output=");
+        write_escaped(file, &job->console.buffer);
+        fputc('\n', file);
+    }
+}
+
+bool run_batch(char* manifest_file_name, char* results_file_name, int worker_count, Engine engine, bool hle, bool lockstep, uint64_t limit) {
+    Batch batch = {0};
+    batch.engine = engine;
+    batch.hle = hle;
+    batch.lockstep = lockstep;
+    batch.limit = limit;
+    if (!read_manifest(&batch, manifest_file_name)) return false;
+    if (batch.job_count > UINT32_MAX) {
+        printf("[ERROR] too many jobs in `%s`\n", manifest_file_name);
+        return false;
+    }
+    init_decode_table(); // before any worker can race on it
+    batch_group_jobs(&batch);
+
+    if (worker_count < 1) worker_count = 1;
+    if ((size_t)worker_count > batch.group_count && batch.group_count > 0) worker_count = (int)batch.group_count;
+    batch.worker_count = worker_count;
+    batch.queues = aligned_alloc(_Alignof(Batch_Queue), sizeof(Batch_Queue) * worker_count);
+    for (int i = 0; i < worker_count; i++) {
+        // hand every worker an even share to start with, stealing evens out the rest
+        uint32_t begin = (uint32_t)(batch.group_count * i / worker_count);
+        uint32_t end = (uint32_t)(batch.group_count * (i + 1) / worker_count);
+        atomic_init(&batch.queues[i].range, batch_range(begin, end));
+    }
+
+    Batch_Worker* workers = malloc(sizeof(*workers) * worker_count);
+    thrd_t* threads = malloc(sizeof(*threads) * worker_count);
+    for (int i = 0; i < worker_count; i++) {
+        workers[i] = (Batch_Worker){ .batch = &batch, .id = i };
+        if (thrd_create(&threads[i], batch_worker, &workers[i]) != thrd_success) {
+            printf("[ERROR] could not start worker thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < worker_count; i++) thrd_join(threads[i], NULL);
+
+    FILE* results = stdout;
+    if (results_file_name != NULL) {
+        results = fopen(results_file_name, "w");
+        if (results == NULL) {
+            printf("[ERROR] could not open specified file `%s`\n", results_file_name);
+            return false;
+        }
+    }
+    write_results(&batch, results);
+    if (results != stdout) fclose(results);
+    return true;
+}
+
 void die_usage(char* program) {
     printf("Usage:\n");
     printf("    %s -os <os_bin_path> -b <executable_bin_path>\n", program);
     printf("for raw files: \n");
     printf("   Usage: -b <executable_bin_path>\n");
-    printf("for os files: \n");
-    printf("   Usage: -os <os_bin_path>\n");
+    printf("for os files, `stock` for the built in os.bin: \n");
+    printf("   Usage: -os <os_bin_path|stock>\n");
+    printf("to pick the interpreter core (default: decode): \n");
+    printf("   Usage: -engine <decode|threaded|jit>\n");
+    printf("to run a manifest of jobs across threads: \n");
+    printf("   Usage: -batch <manifest> [-results <file>] [-threads <n>] [-limit <instructions>] [-lockstep]\n");
+    printf("to print console statistics to stderr on exit: \n");
+    printf("   Usage: -stats\n");
+    printf("to do keyboard and display io on the cpu thread instead of the device thread: \n");
+    printf("   Usage: -sync\n");
+    printf("to run the stock os PUTS, IN and PUTSP routines natively: \n");
+    printf("   Usage: -hle\n");
+    printf("to count executed instructions and print the hot spots to stderr on exit: \n");
+    printf("   Usage: -profile\n");
+    printf("to record a trace of the run, or replay one recorded with the same os and program: \n");
+    printf("   Usage: -record <trace_path> | -replay <trace_path>\n");
+    printf("to feed a file to the keyboard instead of stdin: \n");
+    printf("   Usage: -input <file>\n");
+    printf("to print the time from <ns> (nanoseconds since the epoch, taken before starting vboy) to the first instruction to stderr: \n");
+    printf("   Usage: -startup-clock <ns>\n");
+#if _DEBUGGER
+    printf("to debug the program from commands on stdin or a socket, with a snapshot every n instructions to go back to: \n");
+    printf("   Usage: -debug [-debug-socket <port|path>] [-snapshots <n>]\n");
+    printf("to let gdb attach over a socket, or wait for it before starting: \n");
+    printf("   Usage: -gdb <port|path> [-gdb-wait]\n");
+#endif
     exit(1);
 }
 
+// wall clock time, what `-startup-clock` and the benchmarks measure with
+uint64_t now_nanoseconds() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 void shift(int* argc, char*** argv) {
     assert(argc > 0);
     (*argv)++;
     (*argc)--;
 }
 
+// tools that build on the emulator (see `decode_bench.c`) include this file with VBOY_NO_MAIN
+#ifndef VBOY_NO_MAIN
 int main(int argc, char** argv) {
-    Machine machine = {0};
-    machine.PSR |= PSR_BIT_Z;
-    Memory memory = {0};
+    Machine machine = init_machine();
+    Memory memory = init_sparse_memory(); // only pages that get written cost anything at startup
 
     char* os_file_name = "./os.bin";
     char* program_file_name = 0;
+    char* manifest_file_name = 0;
+    char* results_file_name = 0;
+    char* record_file_name = 0;
+    char* replay_file_name = 0;
+    char* input_file_name = 0;
+#if _DEBUGGER
+    char* debug_socket_name = 0;
+    char* gdb_socket_name = 0;
+    bool gdb_wait = false;
+    uint64_t snapshot_interval = DEBUG_SNAPSHOT_INTERVAL;
+    bool debug = false;
+#endif
+    int worker_count = cpu_count();
+    uint64_t limit = RUN_FOREVER;
+    uint64_t startup_clock = 0;
+    bool lockstep = false;
+    bool stats = false;
+    bool sync_io = false;
     bool loados = false;
     bool loadprogram = false;
 
@@ -603,24 +5388,137 @@ int main(int argc, char** argv) {
             if (i + 1 > argc) die_usage(program);
             program_file_name = argv[i+1];
             loadprogram = true;
+        } else if (strcmp(argv[i], "-engine") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            if (!find_engine(argv[i+1], &machine.engine)) {
+                printf("[ERROR] unknown engine `%s`\n", argv[i+1]);
+                die_usage(program);
+            }
+        } else if (strcmp(argv[i], "-batch") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            manifest_file_name = argv[i+1];
+        } else if (strcmp(argv[i], "-results") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            results_file_name = argv[i+1];
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            worker_count = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-limit") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            limit = strtoull(argv[i+1], NULL, 10);
+        } else if (strcmp(argv[i], "-startup-clock") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            startup_clock = strtoull(argv[i+1], NULL, 10);
+        } else if (strcmp(argv[i], "-lockstep") == 0) {
+            lockstep = true;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            stats = true;
+        } else if (strcmp(argv[i], "-sync") == 0) {
+            sync_io = true;
+        } else if (strcmp(argv[i], "-hle") == 0) {
+            machine.hle = true;
+        } else if (strcmp(argv[i], "-profile") == 0) {
+            machine.profile = calloc(1, sizeof(Profile));
+        } else if (strcmp(argv[i], "-record") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            record_file_name = argv[i+1];
+        } else if (strcmp(argv[i], "-replay") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            replay_file_name = argv[i+1];
+        } else if (strcmp(argv[i], "-input") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            input_file_name = argv[i+1];
+#if _DEBUGGER
+        } else if (strcmp(argv[i], "-debug") == 0) {
+            debug = true;
+        } else if (strcmp(argv[i], "-debug-socket") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            debug_socket_name = argv[i+1];
+            debug = true;
+        } else if (strcmp(argv[i], "-snapshots") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            snapshot_interval = strtoull(argv[i+1], NULL, 10);
+        } else if (strcmp(argv[i], "-gdb") == 0) {
+            if (i + 1 >= argc) die_usage(program);
+            gdb_socket_name = argv[i+1];
+        } else if (strcmp(argv[i], "-gdb-wait") == 0) {
+            gdb_wait = true;
+#endif
         }
     }
 
+    if (manifest_file_name != NULL) {
+        return run_batch(manifest_file_name, results_file_name, worker_count, machine.engine, machine.hle, lockstep, limit) ? 0 : 1;
+    }
     if (!loadprogram && !loados) die_usage(program);
 
-    machine.SSP = MEM_OSSPC_END;            // init supervisor stack
-    memory[MACHINE_CONTROL_REGISTER] = 1;   // init MCR
-    if (loados) {
-        Byte_Data os = read_bin_from_file(os_file_name);
-        if (!map_byte_data(memory, &os, MEM_BEGIN)) exit(1);
-        machine.PC = MEM_OSSPC_BEGIN;
+    Byte_Data os = {0};
+    Byte_Data bin_data = {0};
+    if (loados) os = load_image(os_file_name);
+    if (loadprogram) bin_data = load_image(program_file_name);
+    if (!boot_machine(&machine, memory, loados ? &os : NULL, loadprogram ? &bin_data : NULL)) exit(1);
+    free_image(&os);
+    free_image(&bin_data);
+    Console console = init_console(stdout);
+    machine.console = &console;
+    attach_standard_devices(&machine);
+    Byte_Data no_input = {0};
+    Byte_Data input = {0};
+    if (input_file_name != NULL) {
+        input = load_image(input_file_name);
+        machine.input = &input;
+    }
+#if _DEBUGGER
+    FILE* debug_in = stdin;
+    FILE* debug_out = stdout;
+    if (debug) {
+        if (debug_socket_name != NULL && !accept_debug_client(debug_socket_name, &debug_in, &debug_out)) exit(1);
+        // stdin may have the commands, and going back needs input that reads the same every time
+        if (machine.input == NULL) machine.input = &no_input;
+        machine.timeline = init_timeline(snapshot_interval);
+        machine.debugger = calloc(1, sizeof(Debugger));
+        sync_io = true;
+    }
+#endif
+    if (record_file_name != NULL) {
+        machine.trace = start_recording(record_file_name, &machine, memory);
+        if (machine.trace == NULL) exit(1);
+    } else if (replay_file_name != NULL) {
+        machine.trace = start_replay(replay_file_name, &machine, memory);
+        if (machine.trace == NULL) exit(1);
+        // every key comes out of the trace, the keyboard never gets one
+        machine.input = &no_input;
+        sync_io = true;
+    }
+    Host_Io* host = sync_io ? NULL : malloc(sizeof(*host));
+    if (host != NULL && start_host_io(host, stdout)) {
+        console.host = host;
+        machine.host = host;
+    } else {
+        setvbuf(stdin, NULL, _IONBF, 0);
     }
-    if (loadprogram) {
-        Byte_Data bin_data = read_bin_from_file(program_file_name);
-        if (!map_byte_data(memory, &bin_data, MEM_USERSPC_BEGIN)) exit(1);
+    if (startup_clock != 0) {
+        fprintf(stderr, "startup: %llu ns\n", (unsigned long long)(now_nanoseconds() - startup_clock));
     }
+#if _DEBUGGER
+    if (debug) {
+        debug_session(&machine, memory, debug_in, debug_out);
+    } else if (gdb_socket_name != NULL) {
+        if (!gdb_execute_program(&machine, memory, gdb_socket_name, gdb_wait)) exit(1);
+    } else {
+        execute_program(&machine, memory);
+    }
+#else
     execute_program(&machine, memory);
+#endif
+    if (machine.host != NULL) stop_host_io(machine.host);
+    if (machine.trace != NULL) finish_trace(machine.trace);
     print_machine_state(&machine);
+    if (stats) {
+        fprintf(stderr, "console: %llu bytes written, %llu flushes\n",
+                (unsigned long long)console.bytes, (unsigned long long)console.flushes);
+        if (machine.host != NULL) fprintf(stderr, "idle: %llu polling loops parked\n", (unsigned long long)machine.host->parked);
+    }
+    if (machine.profile != NULL) print_profile(machine.profile, memory, stderr);
 }
-
-
+#endif // VBOY_NO_MAIN